@@ -16,6 +16,8 @@
 #include <cstdlib>
 #include <cstdio>
 
+#include "runqueue.h"
+
 /*
 This program does the following.
 1) Create handlers for two signals.
@@ -137,15 +139,23 @@ struct PCB
     int interrupts;     // number of times interrupted
     int switches;       // may be < interrupts
     int started;        // the time this process started
+    PCB *next;          // links for the NEW or READY queue
+    PCB *prev;
+    RUNQUEUE<PCB> *queue; // the queue this PCB is on, NULL if none
 };
 
 PCB *running;
 PCB *idle;
 
 // http://www.cplusplus.com/reference/list/list/
-list<PCB *> new_list;
 list<PCB *> processes;
 
+// processes waiting to be started, and started processes waiting for the
+// CPU. TERMINATED processes are on neither, so the scheduler never has to
+// walk past them.
+RUNQUEUE<PCB> new_queue;
+RUNQUEUE<PCB> ready_queue;
+
 int sys_time;
 
 /*
@@ -304,63 +314,59 @@ void scheduler(int signum)
     WRITES("---- entering scheduler\n");
     assert(signum == SIGALRM);
     sys_time++;
-        
+
     running->interrupts++;
 
-    bool found_one = false;
-
-    for (int i = 0; i < (int)processes.size(); i++) {
-	    PCB *torun = processes.front();
-	    processes.pop_front();
-	    processes.push_back(torun);
-
-	    if (torun->state == NEW) {
-		    torun->state = RUNNING;
-		    torun->ppid = getpid();
-		    torun->interrupts = 0;
-		    torun->switches = 0;
-		    torun->started = sys_time;
-		    running = torun;
-	            WRITES("Running New: ");
-		    WRITES(torun->name);
-		    WRITES("\n");
-		    if ((torun->pid = fork()) == 0) {
-			    assertsyscall(execl(torun->name, torun->name, NULL),<0);
-		    }
-		    found_one = true;
-		    break;
-	}
-	    else if (torun->state == READY) {
-		    WRITES("continuing");
-		    WRITEI(torun->pid);
-		    WRITES("\n");
-		    if (running->pid != torun->pid) {
-		    	running->switches++;
-			}
-		    torun->state = RUNNING;
-		    running= torun;
-		    if (kill(torun->pid, SIGCONT) == -1) {
-			    assert(kill(0, SIGTERM)==0);
-		    }
-		    found_one = true;
-		    break;
-	    }
-            if(kill(running->pid, SIGCONT) == -1){
-        	WRITES("in sceduler kill error: ");
-       	        WRITEI(errno);
-                WRITES("\n");
-                return;
-            	}
-	}
-    if (!found_one) {
-		    // continuing idle
-		    idle->state = RUNNING;
-		    running = idle;
-		    if (kill (idle->pid, SIGCONT) == -1) {
-			   assert(kill(0, SIGTERM)==0);
-			}
-	    
+    // the interrupted process goes to the back of the line. The idle
+    // process is never queued; it only runs when both queues are empty.
+    if(running != idle && running->state == READY)
+    {
+        rq_push_back(&ready_queue, running);
+    }
+
+    PCB *torun;
+    if((torun = rq_pop_front(&new_queue)) != NULL)
+    {
+        torun->state = RUNNING;
+        torun->ppid = getpid();
+        torun->interrupts = 0;
+        torun->switches = 0;
+        torun->started = sys_time;
+        running = torun;
+        WRITES("Running New: ");
+        WRITES(torun->name);
+        WRITES("\n");
+        if((torun->pid = fork()) == 0)
+        {
+            assertsyscall(execl(torun->name, torun->name, NULL), < 0);
+        }
+    }
+    else if((torun = rq_pop_front(&ready_queue)) != NULL)
+    {
+        WRITES("continuing");
+        WRITEI(torun->pid);
+        WRITES("\n");
+        if(running->pid != torun->pid)
+        {
+            running->switches++;
+        }
+        torun->state = RUNNING;
+        running = torun;
+        if(kill(torun->pid, SIGCONT) == -1)
+        {
+            assert(kill(0, SIGTERM) == 0);
+        }
+    }
+    else
+    {
+        // continuing idle
+        idle->state = RUNNING;
+        running = idle;
+        if(kill(idle->pid, SIGCONT) == -1)
+        {
+            assert(kill(0, SIGTERM) == 0);
         }
+    }
     cout << running;
     WRITES("---- leaving scheduler\n");
 }
@@ -391,6 +397,10 @@ void process_done(int signum)
         else
         {
 	    running->state = TERMINATED;
+	    if(running->queue != NULL)
+	    {
+	        rq_remove(running->queue, running);
+	    }
 	    WRITES("process exited: ");
 	    WRITES("\n");
 	    cout << running;
@@ -446,6 +456,7 @@ void create_idle()
     idle->interrupts = 0;
     idle->switches = 0;
     idle->started = sys_time;
+    idle->queue = NULL;
 
     if((idle->pid = fork()) == 0) //child
     {
@@ -456,6 +467,8 @@ void create_idle()
 
 int main(int argc, char **argv)
 {
+    rq_init(&new_queue);
+    rq_init(&ready_queue);
     boot();
 
     
@@ -469,7 +482,9 @@ int main(int argc, char **argv)
 	process = new(PCB);
 	process->state = NEW;
 	process->name = argv[i];
+	process->queue = NULL;
 	processes.push_back(process);
+	rq_push_back(&new_queue, process);
    	}
 
     
@@ -10,15 +10,36 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <assert.h>
 #include <cstring>
 #include <cstdlib>
 #include <cstdio>
 #include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <string>
 
+#include "sched.h"
+#include "histogram.h"
+#include "kchannel.h"
+#include "kvdso.h"
+#include "kproto.h"
+#include "kmsg.h"
+#include "pidtable.h"
+
 /*
 This program does the following.
 1) Create handlers for two signals.
@@ -100,6 +121,7 @@ Add the following functionality.
 */
 
 #define NUM_SECONDS 20
+#define QUANTUM 1000000     // microseconds between SIGALRMs
 #define EVER ;;
 #define READ 0
 #define WRITE 1
@@ -130,31 +152,76 @@ using namespace std;
 
 #define WRITES(a) { const char *foo = a; write(1, foo, strlen(foo)); }
 #define WRITEI(a) { char buf[10]; assert(eye2eh(a, buf, 10, 10) != -1); WRITES(buf); }
+#define WRITEN(a) { if((a) == 0) { WRITES("        0"); } else { WRITEI(a); } }
 
-enum STATE { NEW, RUNNING, WAITING, READY, TERMINATED };
+// http://www.cplusplus.com/reference/list/list/
+list<PCB *> processes;
 
-struct PCB
+// every started process by pid, sized for the whole process list before
+// boot so that adding one from inside a handler never allocates.
+PIDTABLE<PCB> by_pid;
+
+int quantum = QUANTUM;          // microseconds per tick
+int run_seconds = NUM_SECONDS;
+
+// dispatch latency, in nanoseconds, for each phase of a clock tick:
+//  stop      ISR entry until every CPU's running process is SIGSTOPped
+//  decide    sched_decide() for one CPU
+//  dispatch  the decision until the process is SIGCONTed (or forked)
+//  total     ISR entry until the process is SIGCONTed (or forked)
+// They are dumped on SIGUSR1 and when the kernel is shut down.
+struct histogram hist_stop;
+struct histogram hist_decide;
+struct histogram hist_dispatch;
+struct histogram hist_total;
+struct histogram hist_spawn;    // starting a NEW process, in the kernel
+long long tick_start;           // when the current SIGALRM reached ISR()
+
+// how NEW processes are started (-s):
+//  fork    fork() the kernel, then dup2() and execl() in the child
+//  spawn   posix_spawn() with file actions for the dup2()s
+//  zygote  ask a small fork server, forked before anything else, to do it
+enum SPAWN { SPAWN_FORK, SPAWN_POSIX, SPAWN_ZYGOTE };
+const char *spawn_names[] = { "fork", "spawn", "zygote" };
+SPAWN spawn_method = SPAWN_FORK;
+int zygote_fd = -1;             // the kernel's end of the zygote's socket
+
+// the event loop kernel (-e) only
+bool event_kernel = false;
+int epfd = -1;                  // epoll instance
+int sigfd = -1;                 // signalfd for the kernel's signals
+int tickfd = -1;                // timerfd for the clock
+sigset_t kernel_signals;
+sigset_t user_mask;             // the signal mask children get back
+
+// the epoll data for a process's kc_event is its PCB's address with this
+// bit set, to tell it apart from its request pipe.
+#define DOORBELL 1
+
+// the vDSO page: the kernel's writable mapping, a read-only descriptor for
+// the children, and the records not in use.
+struct kv_page *kv;
+int kv_fd = -1;
+int kv_free[KV_PROCS];
+int kv_nfree;
+
+// the message buffer pool: a descriptor for the children, who owns each
+// buffer, and the buffers nobody does.
+int km_fd = -1;
+PCB *km_owner[KM_BUFS];
+int km_free[KM_BUFS];
+int km_nfree;
+
+// a process's mailbox: the messages sent to it and not yet received, in
+// a ring. The buffers in it already belong to it.
+struct km_mailbox
 {
-    STATE state;
-    const char *name;   // name of the executable
-    int pid;            // process id from fork();
-    int ppid;           // parent process id
-    int interrupts;     // number of times interrupted
-    int switches;       // may be < interrupts
-    int started;        // the time this process started
-    int child2parent[2];
-    int parent2child[2];
-    int processnumber;
+    struct kp_message msgs[KM_SLOTS];
+    int head;
+    int count;
 };
 
-PCB *running;
-PCB *idle;
-
-// http://www.cplusplus.com/reference/list/list/
-list<PCB *> new_list;
-list<PCB *> processes;
-
-int sys_time;
+#define CHILD_FDS 8             // most descriptors a child is given
 
 /*
 ** Async-safe integer to a string. i is assumed to be positive. The number
@@ -212,29 +279,60 @@ void(*ISV[32])(int) = {
 };
 
 /*
-** stop the running process and index into the ISV to call the ISR
+** the wall clock in nanoseconds.
+*/
+long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+/*
+** on a clock interrupt stop the process running on every CPU, then index
+** into the ISV to call the ISR. A SIGTRAP is a kernel call from a running
+** process, so it doesn't preempt anything.
 */
 void ISR(int signum)
 {
-    if(signum != SIGCHLD)
+    if(signum == SIGALRM)
     {
-        if(kill(running->pid, SIGSTOP) == -1)
+        tick_start = now_ns();
+        for(int i = 0; i < num_cpus; i++)
         {
-            WRITES("In ISR kill returned: ");
-            WRITEI(errno);
+            PCB *running = cpus[i].running;
+            if(kill(running->pid, SIGSTOP) == -1)
+            {
+                WRITES("In ISR kill returned: ");
+                WRITEI(errno);
+                WRITES("\n");
+                return;
+            }
+
+            WRITES("In ISR stopped: ");
+            WRITEI(running->pid);
             WRITES("\n");
-            return;
+            running->state = READY;
         }
-
-        WRITES("In ISR stopped: ");
-        WRITEI(running->pid);
-        WRITES("\n");
-        running->state = READY;
+        hist_record(&hist_stop, now_ns() - tick_start);
     }
 
     ISV[signum](signum);
 }
 
+int trap_pid;                   // who sent the SIGTRAP being handled
+
+/*
+** SIGTRAP's handler is installed with SA_SIGINFO so the ISR can tell which
+** process made the kernel call.
+*/
+void trap_ISR(int signum, siginfo_t *info,
+    __attribute__((unused)) void *context)
+{
+    trap_pid = info->si_pid;
+    ISR(signum);
+}
+
 /*
 ** an overloaded output operator that prints a PCB
 */
@@ -248,6 +346,8 @@ ostream& operator <<(ostream &os, struct PCB *pcb)
     os << "switches:     " << pcb->switches << endl;
     os << "started:      " << pcb->started << endl;
     os << "processnumber:      " << pcb->processnumber << endl;
+    os << "priority:     " << pcb->priority << endl;
+    os << "vruntime:     " << pcb->vruntime << endl;
     return(os);
 }
 
@@ -265,20 +365,56 @@ ostream& operator <<(ostream &os, list<PCB *> which)
 }
 
 /*
-**  send signal to process pid every interval for number of times.
+** a timerfd that expires every interval microseconds. It is armed against
+** an absolute CLOCK_MONOTONIC start time, so the time spent handling one
+** tick doesn't push the next one back. If the reader falls behind, read()
+** reports more than one expiration.
+*/
+int tick_timer(int interval)
+{
+    int tfd;
+    assertsyscall(tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC), != -1);
+
+    struct itimerspec its;
+    assertsyscall(clock_gettime(CLOCK_MONOTONIC, &its.it_value), == 0);
+    its.it_interval.tv_sec = interval / 1000000;
+    its.it_interval.tv_nsec = (interval % 1000000) * 1000L;
+    its.it_value.tv_sec += its.it_interval.tv_sec;
+    its.it_value.tv_nsec += its.it_interval.tv_nsec;
+    if(its.it_value.tv_nsec >= 1000000000L)
+    {
+        its.it_value.tv_sec++;
+        its.it_value.tv_nsec -= 1000000000L;
+    }
+    assertsyscall(timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL), == 0);
+    return(tfd);
+}
+
+/*
+**  send signal to process pid every interval microseconds for number of
+**  times, off a tick_timer(). Expirations we fell behind on count against
+**  number but only one signal is sent for them, since they would coalesce
+**  anyway.
 */
 void send_signals(int signal, int pid, int interval, int number)
 {
     dprintt("at beginning of send_signals", getpid());
 
-    for(int i = 1; i <= number; i++)
+    int tfd = tick_timer(interval);
+
+    for(int i = 1; i <= number; )
     {
-        assertsyscall(sleep(interval), == 0);
+        uint64_t expirations;
+        assertsyscall(read(tfd, &expirations, sizeof(expirations)),
+            == sizeof(expirations));
         dprintt("sending", signal);
         dprintt("to", pid);
         assertsyscall(kill(pid, signal), == 0)
+        i += expirations;
     }
 
+    close(tfd);
+
     dmess("at end of send_signals");
 }
 
@@ -303,328 +439,2005 @@ struct sigaction *create_handler(int signum, void(*handler)(int))
         action->sa_flags =  SA_RESTART;
     }
 
+    // the kernel isn't reentrant: its interrupts stay masked while any
+    // one of them is being handled.
     sigemptyset(&(action->sa_mask));
+    sigaddset(&(action->sa_mask), SIGALRM);
+    sigaddset(&(action->sa_mask), SIGCHLD);
+    sigaddset(&(action->sa_mask), SIGTRAP);
     assert(sigaction(signum, action, NULL) == 0);
     return(action);
 }
 
-void scheduler(int signum)
+/*
+** CPU time used so far by pid in nanoseconds, or -1 if it can't be read
+** (e.g. the process has already exited).
+*/
+long long cpu_time_ns(int pid)
 {
-    WRITES("---- entering scheduler\n");
-    assert(signum == SIGALRM);
-    sys_time++;
-        
-    running->interrupts++;
-
-    bool found_one = false;
-
-    for (int i = 0; i < (int)processes.size(); i++) {
-	    PCB *torun = processes.front();
-	    processes.pop_front();
-	    processes.push_back(torun);
-
-
-	    if (torun->state == NEW) {
-		    torun->state = RUNNING;
-		    torun->ppid = getpid();
-		    torun->interrupts = 0;
-		    torun->switches = 0;
-		    torun->started = sys_time;
-		    running = torun;
-	            WRITES("Running New: ");
-		    WRITES(torun->name);
-		    WRITES("\n");
-		    if ((torun->pid = fork()) == 0) { 
-			close(torun->child2parent[READ]);
-           		close(torun->parent2child[WRITE]);
-			//if (torun->processnumber == 1){
-			assertsyscall(dup2(torun->child2parent[WRITE],3),!=-1);
-			assertsyscall(dup2(torun->parent2child[READ],4),!=-1);
-			//}
-			//if (torun->processnumber == 2){
-			//assertsyscall(dup2(torun->child2parent[WRITE],5),!=-1);
-			//assertsyscall(dup2(torun->parent2child[READ],6),!=-1);
-			//}
-			//if (torun->processnumber == 3){
-			//assertsyscall(dup2(torun->child2parent[WRITE],7),!=-1);
-			//assertsyscall(dup2(torun->parent2child[READ],8),!=-1);
-			//}
-			assertsyscall(execl(torun->name, torun->name, NULL),<0);
-		    	}
-		    else {
-			assertsyscall(close(torun->child2parent[WRITE]),==0);
-        	    	assertsyscall(close(torun->parent2child[READ]),==0);
-			}
-		    found_one = true;
-		    break;
-	}
-	    else if (torun->state == READY) {
-		    WRITES("continuing");
-		    WRITEI(torun->pid);
-		    WRITES("\n");
-		    if (running->pid != torun->pid) {
-		    	running->switches++;
-			}
-		    torun->state = RUNNING;
-		    running= torun;
-		    if (kill(torun->pid, SIGCONT) == -1) {
-			    assert(kill(0, SIGTERM)==0);
-		    }
-		    found_one = true;
-		    break;
-	    }
-            if(kill(running->pid, SIGCONT) == -1){
-        	WRITES("in sceduler kill error: ");
-       	        WRITEI(errno);
-                WRITES("\n");
-                return;
-            	}
-	}
-    if (!found_one) {
-		    // continuing idle
-		    idle->state = RUNNING;
-		    running = idle;
-		    if (kill (idle->pid, SIGCONT) == -1) {
-			   assert(kill(0, SIGTERM)==0);
-			}
-	    
-        }
-    //cout << running;
-    WRITES("---- leaving scheduler\n");
+    clockid_t cid;
+    struct timespec ts;
+    if(clock_getcpuclockid(pid, &cid) != 0 || clock_gettime(cid, &ts) == -1)
+    {
+        return(-1);
+    }
+    return((long long)ts.tv_sec * 1000000000LL + ts.tv_nsec);
 }
 
-void pcb_contents(PCB *proc, char *buf)
+/*
+** pin pid (0 for the caller) to cpu's real core.
+*/
+void pin(int pid, CPU *cpu)
 {
-   PCB *process = proc;
-   char buffer1[4];
-
-   strncat(buf, "PCB REQUESTED:", strlen("PCB REQUESTED:"));
-   strncat(buf, buffer1, sizeof(buffer1));
-   
-   assertsyscall(eye2eh(process->state, buffer1, sizeof(buffer1), 10), != -1);
-   strncat(buf, "\nstate:      ", strlen("\nstate:      "));
-   strncat(buf, buffer1, sizeof(buffer1));
-
-   strncat(buf, "\nname:         ", strlen("\nname:         "));
-   strncat(buf, process->name, strlen(process->name));
-
-   char buffer2[8];
-   assertsyscall(eye2eh(process->pid, buffer2, sizeof(buffer2), 10), != -1);
-   strncat(buf, "\npid:         ", strlen("pid:         "));
-   strncat(buf, buffer2, sizeof(buffer2));
-
-   char buffer3[8];
-   assertsyscall(eye2eh(process->ppid, buffer3, sizeof(buffer3), 10), != -1);
-   strncat(buf, "\nppid:        ", strlen("ppid:        "));
-   strncat(buf, buffer3, sizeof(buffer3));
-
-   char buffer4[4];
-   assertsyscall(eye2eh(process->interrupts, buffer4, sizeof(buffer4), 10), != -1);
-   if(process->interrupts == 0)
-   {
-       strncat(buf, "\ninterrupts:   0", strlen("interrupts:    0"));
-   }
-   else
-   {
-       strncat(buf, "\ninterrupts:   ", strlen("interrupts:    "));
-       strncat(buf, buffer4, sizeof(buffer4));
-   }
-
-   char buffer5[4];
-   assertsyscall(eye2eh(process->switches, buffer5, sizeof(buffer5), 10), != -1);
-   if(process->switches == 0)
-   {
-       strncat(buf, "\nswitches:     0", strlen("switches:      0"));
-   }
-   else
-   {
-       strncat(buf, "\nswitches:     ", strlen("switches:      "));
-       strncat(buf, buffer5, sizeof(buffer5));
-   }
-
-   char buffer6[4];
-   assertsyscall(eye2eh(process->started, buffer6, sizeof(buffer6), 10), != -1);
-   strncat(buf, "\nstarted:     ", strlen("started:     "));
-   strncat(buf, buffer6, sizeof(buffer6));
-   strncat(buf, "\n\n", strlen("\n\n"));
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu->core, &set);
+    if(sched_setaffinity(pid, sizeof(set), &set) == -1 && errno != ESRCH)
+    {
+        WRITES("in pin sched_setaffinity error: ");
+        WRITEI(errno);
+        WRITES("\n");
+    }
 }
 
-void all_processes(list<PCB *> proc_list, char *buf)
+/*
+** the kernel's descriptors that p's child gets, in from, and the fd each
+** one becomes in the child, in to. Returns how many there are. The
+** channels are made in this order, so each comes from a descriptor above
+** the one it goes to, and dup2()ing them in order never overwrites one
+** still to be copied; kv_fd and km_fd are kept well above all of them.
+*/
+int child_fds(PCB *p, int *from, int *to)
 {
-	strncat(buf, "PROCESSES LIST: ",strlen("PROCESSES LIST: "));
-    for (int i = 0; i < (int)processes.size(); i++) {
-	    PCB *torun = processes.front();
-	    processes.pop_front();
-	    processes.push_back(torun);
-	    strncat(buf, torun->name,strlen(torun->name));
-   }
-	strncat(buf, "\n",strlen("\n"));
+    int n = 0;
+    from[n] = p->child2parent[WRITE];
+    to[n++] = 3;
+    from[n] = p->parent2child[READ];
+    to[n++] = 4;
+    from[n] = p->kc_fd;
+    to[n++] = KC_FD;
+    if(p->kc_event != -1)
+    {
+        from[n] = p->kc_event;
+        to[n++] = KC_EVENTFD;
+    }
+    if(kv_fd != -1)
+    {
+        from[n] = kv_fd;
+        to[n++] = KV_FD;
+    }
+    if(km_fd != -1)
+    {
+        from[n] = km_fd;
+        to[n++] = KM_FD;
+    }
+    return(n);
 }
 
-
-void incoming_message(int signum)
+/*
+** start p on cpu by forking the kernel. Returns the child's pid, or -1.
+*/
+int fork_process(CPU *cpu, PCB *p)
 {
-    assert(signum == SIGTRAP);
-    WRITES("---- entering incoming_message\n");
-     
-for (int i = 0; i < (int)processes.size(); i++) {
-	    PCB *torun = processes.front();
-	    processes.pop_front();
-	    processes.push_back(torun);
-     	    char buffer1[1024];
-	    char buffer2[1024];
-	    char buffer3[1024];
-            int len = read(torun->child2parent[READ], buffer1, sizeof (buffer1));
-            buffer1[len] = '\0';
-	    char kernel_call = buffer1[0];
-	    if (kernel_call == '1') {
-		std::string string = std::to_string(sys_time);
-		std::string s = "SYSTEM TIME: " + string + "\n";
-		char* message = (char*)s.c_str();
-		assert(write(torun->parent2child[WRITE], message, strlen(message))!= -1);
-		break;
-		}
-	    if (kernel_call == '2') {
-			pcb_contents(torun, buffer2);
-			char* message = (char*)buffer2;
-			assert(write(torun->parent2child[WRITE], message, strlen(message))!= -1);
-			break;
-		}
-	    if (kernel_call == '3') {
-			all_processes(processes, buffer3);
-			char* message = (char*)buffer3;
-			assert(write(torun->parent2child[WRITE], message, strlen(message))!= -1);
-			break;
-		}
-	    if (kernel_call == '4') {
-			char *temp = buffer1;
-			temp++;
-			assert(write(1, temp, strlen(temp))!= -1);
-			printf("\n");
-			break;
-		}
-	
-	
-	}
+    int pid;
+    if((pid = fork()) == 0)
+    {
+        sigprocmask(SIG_SETMASK, &user_mask, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        pin(0, cpu);
+        int from[CHILD_FDS];
+        int to[CHILD_FDS];
+        int n = child_fds(p, from, to);
+        for(int i = 0; i < n; i++)
+        {
+            assertsyscall(dup2(from[i], to[i]), != -1);
+        }
+        assertsyscall(execl(p->name, p->name, NULL), < 0);
+    }
+    return(pid);
 }
 
-
-
-void process_done(int signum)
+/*
+** start p with posix_spawn(). glibc runs the file actions and the exec in
+** a vfork()-style child sharing the kernel's memory, so nothing has to be
+** copied however big the kernel gets. The child can't pin itself, so it
+** is pinned from here once it exists.
+*/
+int spawn_process(CPU *cpu, PCB *p)
 {
-    assert(signum == SIGCHLD);
-    WRITES("---- entering process_done\n");
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    int from[CHILD_FDS];
+    int to[CHILD_FDS];
+    int n = child_fds(p, from, to);
+    for(int i = 0; i < n; i++)
+    {
+        posix_spawn_file_actions_adddup2(&actions, from[i], to[i]);
+    }
 
-    // might have multiple children done.
-    for(int i = 0; i < (int)processes.size(); i++)
+    // inside a handler the kernel's signals are blocked, and it ignores
+    // SIGPIPE; don't pass either on.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &user_mask);
+    sigset_t dfl;
+    sigemptyset(&dfl);
+    sigaddset(&dfl, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &dfl);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+        POSIX_SPAWN_SETSIGDEF);
+
+    int pid;
+    char *const args[] = { (char *)p->name, NULL };
+    int err = posix_spawn(&pid, p->name, &actions, &attr, args, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if(err != 0)
     {
-        int status, cpid;
+        WRITES("posix_spawn error: ");
+        WRITEI(err);
+        WRITES("\n");
+        return(-1);
+    }
+    pin(pid, cpu);
+    return(pid);
+}
 
-        // we know we received a SIGCHLD so don't wait.
-        cpid = waitpid(-1, &status, WNOHANG);
+/*
+** a request to the zygote: where each of the descriptors sent with it goes
+** in the child, then the executable's name.
+*/
+struct ZYGOTE_REQUEST
+{
+    int to[CHILD_FDS];
+    char name[PATH_MAX];
+};
 
-        if(cpid < 0)
+/*
+** The fork server. It is forked before the kernel has set up anything, so
+** forking it stays cheap however big the kernel grows. Each request on
+** its socket is a ZYGOTE_REQUEST, with the child's descriptors attached,
+** in order, as SCM_RIGHTS. The zygote clones a child with CLONE_PARENT, so
+** that the kernel rather than the zygote is its parent and gets its
+** SIGCHLD, and replies with the child's pid.
+*/
+void zygote(int sock)
+{
+    for(EVER)
+    {
+        struct ZYGOTE_REQUEST req;
+        int fds[CHILD_FDS];
+        char control[CMSG_SPACE(sizeof(fds))];
+        struct iovec iov = { &req, sizeof(req) - 1 };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        // the descriptors come close-on-exec, so that none but the ones
+        // dup2()ed into place below get past the exec.
+        ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if(len <= (ssize_t)sizeof(req.to))
         {
-            WRITES("cpid < 0\n");
-            assertsyscall(kill(0, SIGTERM), != 0);
+            // the kernel has gone.
+            exit(0);
         }
-        else if(cpid == 0)
+        req.name[len - sizeof(req.to)] = '\0';
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        assert(cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS);
+        int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+
+        // the kernel's end of the socket, fd 3, was closed and sock holds
+        // fd 4, so the received fds arrive in increasing order at 3, 5, 6
+        // and up: each at or above where it is going, so each dup2() only
+        // overwrites one already copied (or sock, which the child doesn't
+        // need).
+        int pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+        if(pid == 0)
         {
-            // no more children.
-            break;
+            for(int i = 0; i < nfds; i++)
+            {
+                if(fds[i] == req.to[i])
+                {
+                    // already in place: dup2() would leave it close-on-exec.
+                    assertsyscall(fcntl(fds[i], F_SETFD, 0), != -1);
+                    continue;
+                }
+                assertsyscall(dup2(fds[i], req.to[i]), != -1);
+            }
+            assertsyscall(execl(req.name, req.name, NULL), < 0);
         }
-        else
+        for(int i = 0; i < nfds; i++)
         {
-	    running->state = TERMINATED;
-	    WRITES("process exited: ");
-	    WRITES("\n");
-	    cout << running;
-	    int totaltime = sys_time - running->started;
-	    WRITES("Total System Time = ");
-	    WRITEI(totaltime);
-	    WRITES("\n");
+            close(fds[i]);
         }
+        assertsyscall(write(sock, &pid, sizeof(pid)), == sizeof(pid));
     }
-    running = idle;
-    idle->state = RUNNING;
-    WRITES("---- leaving process_done\n");
 }
 
+void create_zygote()
+{
+    int sv[2];
+    assertsyscall(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv),
+        == 0);
+    int pid;
+    assertsyscall(pid = fork(), != -1);
+    if(pid == 0)
+    {
+        close(sv[0]);
+        zygote(sv[1]);
+    }
+    close(sv[1]);
+    zygote_fd = sv[0];
+}
 
 /*
-** set up the "hardware"
+** start p through the zygote.
 */
-void boot()
+int zygote_process(CPU *cpu, PCB *p)
 {
-    sys_time = 0;
+    struct ZYGOTE_REQUEST req;
+    int fds[CHILD_FDS];
+    int nfds = child_fds(p, fds, req.to);
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov[2] = { { req.to, sizeof(req.to) },
+        { (void *)p->name, strlen(p->name) } };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    int pid;
+    if(sendmsg(zygote_fd, &msg, 0) == -1 ||
+        read(zygote_fd, &pid, sizeof(pid)) != sizeof(pid) || pid == -1)
+    {
+        WRITES("zygote error: ");
+        WRITEI(errno);
+        WRITES("\n");
+        return(-1);
+    }
+    pin(pid, cpu);
+    return(pid);
+}
 
-    ISV[SIGALRM] = scheduler; //ISV for SIGALRM sends to scheduler
-    ISV[SIGCHLD] = process_done;
-    ISV[SIGTRAP] = incoming_message;
-    struct sigaction *alarm = create_handler(SIGALRM, ISR); //create handler
-    struct sigaction *child = create_handler(SIGCHLD, ISR); //create handler
-    struct sigaction *trap = create_handler(SIGTRAP, ISR);
+/*
+** close whatever is still open of p's channels.
+*/
+void close_channels(PCB *p)
+{
+    if(event_kernel && p->child2parent[READ] != -1)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, p->child2parent[READ], NULL);
+    }
+    if(event_kernel && p->kc_event != -1)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, p->kc_event, NULL);
+    }
+    int *fds[] = { &p->child2parent[READ], &p->child2parent[WRITE],
+        &p->parent2child[READ], &p->parent2child[WRITE], &p->kc_fd,
+        &p->kc_event };
+    for(int i = 0; i < (int)(sizeof(fds) / sizeof(fds[0])); i++)
+    {
+        if(*fds[i] != -1)
+        {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+    if(p->kc != NULL)
+    {
+        munmap(p->kc, sizeof(struct kc_region));
+        p->kc = NULL;
+    }
+}
 
-    // start up clock interrupt
-    int ret;
-    if((ret = fork()) == 0) //create a child
+/*
+** make the channels between the kernel and p: the two pipes, and the
+** shared kernel-call rings with their doorbell. They are only made when p
+** is started, and closed again when it exits, so only live processes hold
+** descriptors. Everything is close-on-exec so that no other child
+** inherits it; the child's own ends survive as the dup2()ed fds 3 to 6.
+** Returns false if the kernel is out of descriptors.
+*/
+bool open_channels(PCB *p)
+{
+    if(pipe2(p->child2parent, O_CLOEXEC) == -1 ||
+        pipe2(p->parent2child, O_CLOEXEC) == -1 ||
+        (p->kc_fd = memfd_create("kchannel", MFD_CLOEXEC)) == -1 ||
+        ftruncate(p->kc_fd, sizeof(struct kc_region)) == -1)
+    {
+        close_channels(p);
+        return(false);
+    }
+    void *kc = mmap(NULL, sizeof(struct kc_region), PROT_READ | PROT_WRITE,
+        MAP_SHARED, p->kc_fd, 0);
+    if(kc == MAP_FAILED)
+    {
+        close_channels(p);
+        return(false);
+    }
+    p->kc = (struct kc_region *)kc;
+    p->kc->notify = KC_NOTIFY_SIGNAL;
+    if(event_kernel)
+    {
+        if((p->kc_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+        {
+            close_channels(p);
+            return(false);
+        }
+        p->kc->notify = KC_NOTIFY_EVENTFD;
+    }
+
+    int fl = fcntl(p->child2parent[READ], F_GETFL);
+    fcntl(p->child2parent[READ], F_SETFL, fl | O_NONBLOCK);
+    return(true);
+}
+
+/*
+** make the vDSO page. The children get a read-only descriptor for it,
+** reopened through /proc, so they can't map it writable.
+*/
+void create_vdso()
+{
+    int fd;
+    assertsyscall(fd = memfd_create("kvdso", MFD_CLOEXEC), != -1);
+    assertsyscall(ftruncate(fd, sizeof(struct kv_page)), == 0);
+    void *page = mmap(NULL, sizeof(struct kv_page), PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    assertsyscall(page, != MAP_FAILED);
+    kv = (struct kv_page *)page;
+    kv->quantum = quantum;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    int ro;
+    assertsyscall(ro = open(path, O_RDONLY | O_CLOEXEC), != -1);
+    assertsyscall(kv_fd = fcntl(ro, F_DUPFD_CLOEXEC, 100), != -1);
+    close(ro);
+    close(fd);
+
+    for(int i = KV_PROCS - 1; i >= 0; i--)
     {
-        send_signals(SIGALRM, getppid(), 1, NUM_SECONDS);
+        kv_free[kv_nfree++] = i;
+    }
+}
 
-        // once that's done, cleanup and really kill everything...
-        delete(alarm);
-        delete(child);
-        delete(trap);
-        delete(idle);
-        kill(0, SIGTERM);
+/*
+** make the message buffer pool. The kernel never touches the payloads,
+** so it doesn't map the pool itself.
+*/
+void create_kmsg()
+{
+    int fd;
+    assertsyscall(fd = memfd_create("kmsg", MFD_CLOEXEC), != -1);
+    assertsyscall(ftruncate(fd, (off_t)KM_BUFS * KM_BUF), == 0);
+    assertsyscall(km_fd = fcntl(fd, F_DUPFD_CLOEXEC, 100), != -1);
+    close(fd);
+
+    for(int i = KM_BUFS - 1; i >= 0; i--)
+    {
+        km_owner[i] = NULL;
+        km_free[km_nfree++] = i;
     }
+}
 
-    if(ret < 0)
+/*
+** give p a buffer. Returns it, or -1 if there are none left.
+*/
+int km_alloc(PCB *p)
+{
+    if(km_nfree == 0)
     {
-        perror("fork");
+        return(-1);
     }
+    int buf = km_free[--km_nfree];
+    km_owner[buf] = p;
+    return(buf);
 }
 
-void create_idle()
+/*
+** p gives back buf. Returns 0, or -errno.
+*/
+int km_put(PCB *p, int buf)
 {
-    idle = new(PCB);
-    idle->state = READY;
-    idle->name = "IDLE";
-    idle->ppid = getpid();
-    idle->interrupts = 0;
-    idle->switches = 0;
-    idle->started = sys_time;
+    if(buf < 0 || buf >= KM_BUFS)
+    {
+        return(-EINVAL);
+    }
+    if(km_owner[buf] != p)
+    {
+        return(-EPERM);
+    }
+    km_owner[buf] = NULL;
+    km_free[km_nfree++] = buf;
+    return(0);
+}
 
-    if((idle->pid = fork()) == 0) //child
+/*
+** p has exited: everything it owned, including whatever is still in its
+** mailbox, goes back in the pool.
+*/
+void km_release(PCB *p)
+{
+    if(km_fd == -1)
     {
-        pause();
-        perror("pause in create_idle");
+        return;
+    }
+    for(int buf = 0; buf < KM_BUFS; buf++)
+    {
+        if(km_owner[buf] == p)
+        {
+            km_put(p, buf);
+        }
     }
+    p->mailbox->count = 0;
 }
 
-int main(int argc, char **argv)
+/*
+** publish the time of the tick now being handled.
+*/
+void kv_tick()
 {
-    boot();
+    if(kv == NULL)
+    {
+        return;
+    }
+    kv_write_begin(&kv->seq);
+    kv->sys_time = sys_time;
+    kv->tick_ns = tick_start;
+    kv_write_end(&kv->seq);
+}
 
-    
-    create_idle();
-    running = idle;
-    cout << running;
-	
-    for (int i = 1; i < argc; i++) {
-	PCB *process;
-	process = new(PCB);
-	process->state = NEW;
-	process->name = argv[i];
-	assertsyscall(pipe(process->child2parent),== 0);
-        assertsyscall(pipe(process->parent2child),== 0);
-	process->processnumber = i;
-	processes.push_back(process);
-	int fl;
-    	fl = fcntl(process->child2parent[READ], F_GETFL);
-        fcntl(process->child2parent[READ], F_SETFL, fl | O_NONBLOCK);
-		
-   	}
+/*
+** publish p's counters in its record.
+*/
+void kv_publish(PCB *p)
+{
+    if(p->kv_slot == -1)
+    {
+        return;
+    }
+    struct kv_pcb *rec = &kv->procs[p->kv_slot];
+    kv_write_begin(&rec->seq);
+    rec->pid = p->pid;
+    rec->ppid = p->ppid;
+    rec->state = p->state;
+    rec->interrupts = p->interrupts;
+    rec->switches = p->switches;
+    rec->started = p->started;
+    rec->processnumber = p->processnumber;
+    rec->priority = p->priority;
+    rec->cpu = p->cpu;
+    rec->cpu_ns = p->cpu_ns;
+    rec->wait_ns = p->wait_ns;
+    kv_write_end(&rec->seq);
+}
+
+/*
+** give p a record, if there are any left, before it is started, and tell
+** it which through its kc_region.
+*/
+void kv_open(PCB *p)
+{
+    if(kv != NULL && kv_nfree > 0)
+    {
+        p->kv_slot = kv_free[--kv_nfree];
+        kv_publish(p);
+    }
+    p->kc->kv_slot = p->kv_slot;
+}
+
+void kv_close(PCB *p)
+{
+    if(p->kv_slot == -1)
+    {
+        return;
+    }
+    struct kv_pcb *rec = &kv->procs[p->kv_slot];
+    kv_write_begin(&rec->seq);
+    rec->pid = 0;
+    kv_write_end(&rec->seq);
+    kv_free[kv_nfree++] = p->kv_slot;
+    p->kv_slot = -1;
+}
+
+int start_process(CPU *cpu, PCB *p)
+{
+    if(!open_channels(p))
+    {
+        WRITES("out of descriptors for pipes: ");
+        WRITEI(errno);
+        WRITES("\n");
+        return(-1);
+    }
+    kv_open(p);
+
+    switch(spawn_method)
+    {
+    case SPAWN_POSIX:
+        return(spawn_process(cpu, p));
+    case SPAWN_ZYGOTE:
+        return(zygote_process(cpu, p));
+    default:
+        return(fork_process(cpu, p));
+    }
+}
+
+/*
+** put torun (NULL for idle) on cpu in place of running, which has already
+** been stopped: start it if it is NEW, otherwise continue it.
+*/
+void dispatch(CPU *cpu, PCB *running, PCB *torun)
+{
+    // the interrupted process starts waiting if it lost the CPU, and
+    // whoever gets the CPU stops.
+    long long now = now_ns();
+    if(running != cpu->idle && running != torun && running->state == READY)
+    {
+        running->ready_since = now;
+    }
+    if(torun != NULL && torun != running)
+    {
+        torun->wait_ns += now - torun->ready_since;
+    }
+
+    if(torun != NULL && torun->state == NEW)
+    {
+        sched_switch(cpu, torun);
+        torun->ppid = getpid();
+        torun->started_ns = now;
+        WRITES("Running New: ");
+        WRITES(torun->name);
+        WRITES("\n");
+        torun->pid = start_process(cpu, torun);
+        hist_record(&hist_spawn, now_ns() - now);
+        if(torun->pid == -1)
+        {
+            // it never ran; give its time to idle.
+            close_channels(torun);
+            kv_close(torun);
+            sched_exit(cpu, torun);
+            kill(cpu->idle->pid, SIGCONT);
+        }
+        else
+        {
+            pid_insert(&by_pid, torun);
+            assertsyscall(close(torun->child2parent[WRITE]), == 0);
+            assertsyscall(close(torun->parent2child[READ]), == 0);
+            assertsyscall(close(torun->kc_fd), == 0);
+            torun->child2parent[WRITE] = -1;
+            torun->parent2child[READ] = -1;
+            torun->kc_fd = -1;
+            if(event_kernel)
+            {
+                struct epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.ptr = torun;
+                assertsyscall(epoll_ctl(epfd, EPOLL_CTL_ADD,
+                    torun->child2parent[READ], &ev), == 0);
+                ev.data.ptr = (void *)((uintptr_t)torun | DOORBELL);
+                assertsyscall(epoll_ctl(epfd, EPOLL_CTL_ADD,
+                    torun->kc_event, &ev), == 0);
+            }
+        }
+    }
+    else if(torun != NULL)
+    {
+        WRITES("continuing");
+        WRITEI(torun->pid);
+        WRITES("\n");
+        if(torun->cpu != cpu->id)
+        {
+            WRITES("cpu");
+            WRITEN(cpu->id);
+            WRITES(" stole from cpu");
+            WRITEN(torun->cpu);
+            WRITES("\n");
+            pin(torun->pid, cpu);
+        }
+        sched_switch(cpu, torun);
+        if(kill(torun->pid, SIGCONT) == -1)
+        {
+            assert(kill(0, SIGTERM) == 0);
+        }
+    }
+    else
+    {
+        // continuing idle
+        sched_switch(cpu, NULL);
+        if(kill(cpu->idle->pid, SIGCONT) == -1)
+        {
+            assert(kill(0, SIGTERM) == 0);
+        }
+    }
+
+    kv_publish(running);
+    if(torun != NULL && torun != running)
+    {
+        kv_publish(torun);
+    }
+}
+
+void schedule_cpu(CPU *cpu)
+{
+    long long start = now_ns();
+    PCB *running = cpu->running;
+    if(running != cpu->idle && running->state == READY)
+    {
+        long long used = cpu_time_ns(running->pid);
+        if(used > running->cpu_ns)
+        {
+            running->cpu_ns = used;
+        }
+    }
+
+    PCB *torun = sched_decide(cpu);
+    long long now = now_ns();
+    hist_record(&hist_decide, now - start);
+
+    dispatch(cpu, running, torun);
+
+    long long done = now_ns();
+    hist_record(&hist_dispatch, done - now);
+    hist_record(&hist_total, done - tick_start);
+}
+
+/*
+** if cpu is idle but someone is now READY, run them straight away rather
+** than at the next tick.
+*/
+void kick(CPU *cpu)
+{
+    if(cpu->running != cpu->idle)
+    {
+        return;
+    }
+    PCB *torun = sched_next(cpu);
+    if(torun == NULL)
+    {
+        return;
+    }
+    kill(cpu->idle->pid, SIGSTOP);
+    dispatch(cpu, cpu->idle, torun);
+}
+
+/*
+** p, running on cpu, is coming off it: stop it and note the CPU it used.
+*/
+void stop_running(PCB *p)
+{
+    kill(p->pid, SIGSTOP);
+    long long used = cpu_time_ns(p->pid);
+    if(used > p->cpu_ns)
+    {
+        p->cpu_ns = used;
+    }
+}
+
+bool ring_calls(PCB *p);
+
+/*
+** send p the len byte reply on its pipe. If p has stopped reading it, the
+** reply is dropped: what a child does with its end is up to the child,
+** and its SIGCHLD tidies up after it.
+*/
+void reply_to(PCB *p, const char *reply, int len)
+{
+    if(write(p->parent2child[WRITE], reply, len) == -1)
+    {
+        WRITES("reply to ");
+        WRITEI(p->pid);
+        WRITES(" lost\n");
+    }
+}
+
+/*
+** WAITING p's blocking call is done: send it the response it has been
+** waiting for, on the channel the call came in on, and put it back on a
+** run queue. Then serve anything it queued on its ring behind the call.
+*/
+void wake(PCB *p, int status, const void *body, int len)
+{
+    char reply[KP_MAX];
+    int hdr = sizeof(struct kp_header);
+    kp_set_header(reply, p->pending_op, p->pending_id, len, status);
+    if(len > 0)
+    {
+        memcpy(reply + hdr, body, len);
+    }
+    p->pending_op = -1;
+    if(p->pending_ring)
+    {
+        // ring_calls() kept a response slot for the call when it blocked,
+        // and nothing goes on p's responses until this one has, so it
+        // can't be full, whatever the child has done to head meanwhile.
+        struct kc_slot *slot = kc_reserved_slot(&p->kc->responses);
+        memcpy(slot->data, reply, hdr + len);
+        slot->len = hdr + len;
+        kc_push(&p->kc->responses);
+    }
+    else
+    {
+        reply_to(p, reply, hdr + len);
+    }
+
+    sched_wake(p);
+    p->ready_since = now_ns();
+    kv_publish(p);
+    ring_calls(p);
+}
+
+/*
+** wake the processes whose sleep is up. They get the CPU the usual way,
+** once scheduler() gets to their CPU.
+*/
+void wake_sleepers()
+{
+    RUNQUEUE<PCB> woken;
+    rq_init(&woken);
+    tw_advance(&sleepers, sys_time, &woken);
+
+    struct kp_time t;
+    t.sys_time = sys_time;
+    t.quantum = quantum;
+    t.tick_ns = tick_start;
+    PCB *p;
+    while((p = rq_pop_front(&woken)) != NULL)
+    {
+        // off the wheel already; wake() needn't cancel anything.
+        wake(p, 0, &t, sizeof(t));
+    }
+}
+
+void scheduler(int signum)
+{
+    WRITES("---- entering scheduler\n");
+    assert(signum == SIGALRM);
+    sys_time++;
+    kv_tick();
+    wake_sleepers();
+
+    for(int i = 0; i < num_cpus; i++)
+    {
+        schedule_cpu(&cpus[i]);
+    }
+    WRITES("---- leaving scheduler\n");
+}
+
+void pcb_contents(PCB *proc, char *buf)
+{
+   PCB *process = proc;
+   char buffer1[4];
+
+   strncat(buf, "PCB REQUESTED:", strlen("PCB REQUESTED:"));
+   
+   assertsyscall(eye2eh(process->state, buffer1, sizeof(buffer1), 10), != -1);
+   strncat(buf, "\nstate:      ", strlen("\nstate:      "));
+   strncat(buf, buffer1, sizeof(buffer1));
+
+   strncat(buf, "\nname:         ", strlen("\nname:         "));
+   strncat(buf, process->name, strlen(process->name));
+
+   char buffer2[8];
+   assertsyscall(eye2eh(process->pid, buffer2, sizeof(buffer2), 10), != -1);
+   strncat(buf, "\npid:         ", strlen("pid:         "));
+   strncat(buf, buffer2, sizeof(buffer2));
+
+   char buffer3[8];
+   assertsyscall(eye2eh(process->ppid, buffer3, sizeof(buffer3), 10), != -1);
+   strncat(buf, "\nppid:        ", strlen("ppid:        "));
+   strncat(buf, buffer3, sizeof(buffer3));
+
+   char buffer4[4];
+   assertsyscall(eye2eh(process->interrupts, buffer4, sizeof(buffer4), 10), != -1);
+   if(process->interrupts == 0)
+   {
+       strncat(buf, "\ninterrupts:   0", strlen("interrupts:    0"));
+   }
+   else
+   {
+       strncat(buf, "\ninterrupts:   ", strlen("interrupts:    "));
+       strncat(buf, buffer4, sizeof(buffer4));
+   }
+
+   char buffer5[4];
+   assertsyscall(eye2eh(process->switches, buffer5, sizeof(buffer5), 10), != -1);
+   if(process->switches == 0)
+   {
+       strncat(buf, "\nswitches:     0", strlen("switches:      0"));
+   }
+   else
+   {
+       strncat(buf, "\nswitches:     ", strlen("switches:      "));
+       strncat(buf, buffer5, sizeof(buffer5));
+   }
+
+   char buffer6[4];
+   assertsyscall(eye2eh(process->started, buffer6, sizeof(buffer6), 10), != -1);
+   strncat(buf, "\nstarted:     ", strlen("started:     "));
+   strncat(buf, buffer6, sizeof(buffer6));
+   strncat(buf, "\n\n", strlen("\n\n"));
+}
+
+/*
+** the names of the processes, as many as fit in the size bytes of buf.
+*/
+void all_processes(list<PCB *> &proc_list, char *buf, size_t size)
+{
+    strncat(buf, "PROCESSES LIST: ", size - strlen(buf) - 1);
+    list<PCB *>::iterator PCB_iter;
+    for(PCB_iter = proc_list.begin(); PCB_iter != proc_list.end(); PCB_iter++)
+    {
+        // leave room for the newline.
+        if(strlen(buf) + strlen((*PCB_iter)->name) + 2 > size)
+        {
+            break;
+        }
+        strcat(buf, (*PCB_iter)->name);
+    }
+    strcat(buf, "\n");
+}
+
+
+/*
+** serve the one binary request h, whose payload follows it, for p. The
+** response goes in the room bytes at out; its length is returned, or -1
+** if it won't fit.
+*/
+int kp_serve_one(PCB *p, struct kp_header h, const char *payload, char *out,
+    int room)
+{
+    int hdr = sizeof(struct kp_header);
+    int status = 0;
+    int body = 0;
+    if(hdr > room)
+    {
+        return(-1);
+    }
+    if(h.magic != KP_MAGIC || h.version != KP_VERSION)
+    {
+        status = KP_EPROTO;
+    }
+    else if(h.opcode == KP_TIME)
+    {
+        struct kp_time t;
+        t.sys_time = sys_time;
+        t.quantum = quantum;
+        t.tick_ns = tick_start;
+        body = sizeof(t);
+        if(hdr + body > room)
+        {
+            return(-1);
+        }
+        memcpy(out + hdr, &t, sizeof(t));
+    }
+    else if(h.opcode == KP_PCB)
+    {
+        struct kp_pcb c;
+        c.pid = p->pid;
+        c.ppid = p->ppid;
+        c.state = p->state;
+        c.interrupts = p->interrupts;
+        c.switches = p->switches;
+        c.started = p->started;
+        c.processnumber = p->processnumber;
+        c.priority = p->priority;
+        c.cpu = p->cpu;
+        c.pad = 0;
+        c.cpu_ns = p->cpu_ns;
+        c.wait_ns = p->wait_ns;
+        body = sizeof(c);
+        if(hdr + body > room)
+        {
+            return(-1);
+        }
+        memcpy(out + hdr, &c, sizeof(c));
+    }
+    else if(h.opcode == KP_LIST)
+    {
+        struct kp_list l;
+        l.first = 0;
+        if(h.length >= sizeof(l.first))
+        {
+            memcpy(&l.first, payload, sizeof(l.first));
+        }
+        l.total = processes.size();
+        l.count = 0;
+        l.pad = 0;
+        body = sizeof(l);
+        if(hdr + body > room)
+        {
+            return(-1);
+        }
+
+        // as many as fit.
+        uint32_t i = 0;
+        list<PCB *>::iterator PCB_iter;
+        for(PCB_iter = processes.begin(); PCB_iter != processes.end();
+            PCB_iter++)
+        {
+            if(i++ < l.first)
+            {
+                continue;
+            }
+            if(hdr + body + (int)sizeof(struct kp_list_entry) > room)
+            {
+                break;
+            }
+            struct kp_list_entry e;
+            memset(&e, 0, sizeof(e));
+            e.pid = (*PCB_iter)->pid;
+            e.state = (*PCB_iter)->state;
+            e.processnumber = (*PCB_iter)->processnumber;
+            strncpy(e.name, (*PCB_iter)->name, sizeof(e.name) - 1);
+            memcpy(out + hdr + body, &e, sizeof(e));
+            body += sizeof(e);
+            l.count++;
+        }
+        memcpy(out + hdr, &l, sizeof(l));
+    }
+    else if(h.opcode == KP_PRINT)
+    {
+        // kp_serve() has checked h.length against the message.
+        if(write(1, payload, h.length) == -1)
+        {
+            status = -errno;
+        }
+    }
+    else if(h.opcode == KP_ALLOC)
+    {
+        struct kp_buf b;
+        b.size = KM_BUF;
+        body = sizeof(b);
+        if(hdr + body > room)
+        {
+            return(-1);
+        }
+        if((b.buf = km_alloc(p)) == -1)
+        {
+            status = -ENOMEM;
+        }
+        memcpy(out + hdr, &b, sizeof(b));
+    }
+    else if(h.opcode == KP_FREE)
+    {
+        int32_t buf = -1;
+        if(h.length >= sizeof(buf))
+        {
+            memcpy(&buf, payload, sizeof(buf));
+        }
+        status = km_put(p, buf);
+    }
+    else if(h.opcode == KP_YIELD || h.opcode == KP_SLEEP ||
+        h.opcode == KP_WAIT || h.opcode == KP_SEND || h.opcode == KP_RECV)
+    {
+        // blocking calls can't be batched.
+        status = -EINVAL;
+    }
+    else
+    {
+        status = -ENOSYS;
+    }
+
+    kp_set_header(out, h.opcode, h.id, body, status);
+    return(hdr + body);
+}
+
+/*
+** the exit of TERMINATED process p, for KP_WAIT.
+*/
+struct kp_exit exit_of(PCB *p)
+{
+    struct kp_exit e;
+    e.pid = p->pid;
+    e.status = p->status;
+    e.utime_us = p->utime_us;
+    e.stime_us = p->stime_us;
+    return(e);
+}
+
+/*
+** p's blocking call h has to wait: p goes WAITING with the call pending,
+** until ticks from now if on is NULL and ticks is positive, until on
+** exits or takes a message from it if on isn't, or otherwise until
+** whatever it is waiting for wakes it. Its CPU goes to whoever is next.
+** Returns 0, the length of the response for now.
+*/
+int block(PCB *p, struct kp_header h, PCB *on, int ticks)
+{
+    CPU *cpu = &cpus[p->cpu];
+    bool running = (cpu->running == p);
+    if(running)
+    {
+        stop_running(p);
+    }
+    p->pending_op = h.opcode;
+    p->pending_id = h.id;
+    p->pending_ring = false;
+    if(on != NULL)
+    {
+        sched_wait(cpu, p, on);
+    }
+    else if(ticks > 0)
+    {
+        sched_sleep(cpu, p, ticks);
+    }
+    else
+    {
+        sched_block(cpu, p);
+    }
+    if(running)
+    {
+        dispatch(cpu, p, sched_next(cpu));
+    }
+    else
+    {
+        kv_publish(p);
+    }
+    return(0);
+}
+
+/*
+** put buf, len bytes of it from from, in to's mailbox, which has room, or
+** straight into the hands of to if it is waiting in KP_RECV.
+*/
+void km_deliver(PCB *from, PCB *to, int buf, int len)
+{
+    struct kp_message m;
+    m.pid = from->pid;
+    m.buf = buf;
+    m.len = len;
+    m.pad = 0;
+    km_owner[buf] = to;
+    if(to->pending_op == KP_RECV)
+    {
+        wake(to, 0, &m, sizeof(m));
+        return;
+    }
+    struct km_mailbox *box = to->mailbox;
+    box->msgs[(box->head + box->count) % KM_SLOTS] = m;
+    box->count++;
+}
+
+/*
+** KP_SEND for p: hand over the buffer in m to m.pid, waiting for room in
+** its mailbox if it is full.
+*/
+int km_send(PCB *p, struct kp_header h, struct kp_message m, char *reply)
+{
+    int hdr = sizeof(struct kp_header);
+    PCB *to = pid_find(&by_pid, m.pid);
+
+    int status = 0;
+    if(to == NULL)
+    {
+        status = -ESRCH;
+    }
+    else if(m.buf < 0 || m.buf >= KM_BUFS || m.len < 0 || m.len > KM_BUF)
+    {
+        status = -EINVAL;
+    }
+    else if(km_owner[m.buf] != p)
+    {
+        status = -EPERM;
+    }
+    else if(to->pending_op == KP_RECV || to->mailbox->count < KM_SLOTS)
+    {
+        km_deliver(p, to, m.buf, m.len);
+    }
+    else if(to == p)
+    {
+        // it would never get round to making room.
+        status = -EDEADLK;
+    }
+    else
+    {
+        p->pending_arg[0] = m.pid;
+        p->pending_arg[1] = m.buf;
+        p->pending_arg[2] = m.len;
+        return(block(p, h, to, 0));
+    }
+    kp_set_header(reply, h.opcode, h.id, 0, status);
+    return(hdr);
+}
+
+/*
+** KP_RECV for p: take the oldest message in its mailbox, or wait for one.
+** A sender that was waiting for the room gets it.
+*/
+int km_recv(PCB *p, struct kp_header h, char *reply)
+{
+    int hdr = sizeof(struct kp_header);
+    struct km_mailbox *box = p->mailbox;
+    if(box->count == 0)
+    {
+        return(block(p, h, NULL, 0));
+    }
+    struct kp_message m = box->msgs[box->head];
+    box->head = (box->head + 1) % KM_SLOTS;
+    box->count--;
+    kp_set_header(reply, h.opcode, h.id, sizeof(m), 0);
+    memcpy(reply + hdr, &m, sizeof(m));
+
+    for(PCB *sender = p->waiters.head; sender != NULL; sender = sender->next)
+    {
+        if(sender->pending_op == KP_SEND)
+        {
+            km_deliver(sender, p, sender->pending_arg[1],
+                sender->pending_arg[2]);
+            wake(sender, 0, NULL, 0);
+            break;
+        }
+    }
+    return(hdr + sizeof(m));
+}
+
+/*
+** serve the blocking call h, whose payload follows it, for p. If it has
+** to wait, block() takes p off the CPU and 0 is returned; wake() sends
+** the response later. Otherwise the response goes in reply, which has
+** room for KP_MAX bytes, and its length is returned.
+*/
+int kp_block(PCB *p, struct kp_header h, const char *payload, char *reply)
+{
+    int hdr = sizeof(struct kp_header);
+    CPU *cpu = &cpus[p->cpu];
+    int32_t arg = 0;
+    if(h.length >= sizeof(arg))
+    {
+        memcpy(&arg, payload, sizeof(arg));
+    }
+
+    if(h.opcode == KP_SEND)
+    {
+        struct kp_message m;
+        memset(&m, 0, sizeof(m));
+        memcpy(&m, payload, h.length < sizeof(m) ? h.length : sizeof(m));
+        return(km_send(p, h, m, reply));
+    }
+    if(h.opcode == KP_RECV)
+    {
+        return(km_recv(p, h, reply));
+    }
+
+    if(h.opcode == KP_YIELD || (h.opcode == KP_SLEEP && arg <= 0))
+    {
+        // a READY process has already been taken off the CPU.
+        if(cpu->running == p)
+        {
+            PCB *torun = sched_yield_cpu(cpu, p);
+            if(torun != NULL)
+            {
+                stop_running(p);
+                dispatch(cpu, p, torun);
+            }
+        }
+        if(h.opcode == KP_YIELD)
+        {
+            kp_set_header(reply, h.opcode, h.id, 0, 0);
+            return(hdr);
+        }
+        struct kp_time t;
+        t.sys_time = sys_time;
+        t.quantum = quantum;
+        t.tick_ns = tick_start;
+        kp_set_header(reply, h.opcode, h.id, sizeof(t), 0);
+        memcpy(reply + hdr, &t, sizeof(t));
+        return(hdr + sizeof(t));
+    }
+    if(h.opcode == KP_SLEEP)
+    {
+        return(block(p, h, NULL, arg));
+    }
+
+    // KP_WAIT
+    PCB *on = pid_find(&by_pid, arg);
+    if(on == p)
+    {
+        kp_set_header(reply, h.opcode, h.id, 0, -EDEADLK);
+        return(hdr);
+    }
+    if(on != NULL)
+    {
+        return(block(p, h, on, 0));
+    }
+
+    // it may have exited already.
+    list<PCB *>::iterator PCB_iter;
+    for(PCB_iter = processes.begin(); PCB_iter != processes.end(); PCB_iter++)
+    {
+        if((*PCB_iter)->state == TERMINATED && (*PCB_iter)->pid == arg &&
+            arg > 0)
+        {
+            struct kp_exit e = exit_of(*PCB_iter);
+            kp_set_header(reply, h.opcode, h.id, sizeof(e), 0);
+            memcpy(reply + hdr, &e, sizeof(e));
+            return(hdr + sizeof(e));
+        }
+    }
+    kp_set_header(reply, h.opcode, h.id, 0, -ESRCH);
+    return(hdr);
+}
+
+/*
+** serve the binary message at request (len bytes) for p: one request, or
+** a batch of them. The response goes in the size bytes at reply, and its
+** length is returned.
+*/
+int kp_serve(PCB *p, const char *request, int len, char *reply, int size)
+{
+    int hdr = sizeof(struct kp_header);
+    if(len < hdr || size < hdr)
+    {
+        return(0);
+    }
+    struct kp_header h = kp_get_header(request);
+    int want = kp_message_len(request);
+    if(h.version != KP_VERSION || want < 0 || want > len)
+    {
+        kp_set_header(reply, h.opcode, h.id, 0, KP_EPROTO);
+        return(hdr);
+    }
+    if(p->pending_op != -1)
+    {
+        // still in a blocking call.
+        kp_set_header(reply, h.opcode, h.id, 0, -EBUSY);
+        return(hdr);
+    }
+    if(h.opcode == KP_YIELD || h.opcode == KP_SLEEP ||
+        h.opcode == KP_WAIT || h.opcode == KP_SEND || h.opcode == KP_RECV)
+    {
+        return(kp_block(p, h, request + hdr, reply));
+    }
+    if(h.opcode != KP_BATCH)
+    {
+        int n = kp_serve_one(p, h, request + hdr, reply, size);
+        if(n == -1)
+        {
+            kp_set_header(reply, h.opcode, h.id, 0, -ENOSPC);
+            n = hdr;
+        }
+        return(n);
+    }
+
+    // count the requests first, so as always to leave room to say which
+    // ones didn't fit. Every request is at least a header, so the batch
+    // being no bigger than size means there is.
+    int count = 0;
+    int off = 0;
+    while(kp_next(request, &off) != NULL)
+    {
+        count++;
+    }
+    if(off != (int)h.length)
+    {
+        // a request in it runs past the end.
+        kp_set_header(reply, h.opcode, h.id, 0, KP_EPROTO);
+        return(hdr);
+    }
+
+    int at = hdr;
+    const char *next;
+    off = 0;
+    while((next = kp_next(request, &off)) != NULL)
+    {
+        count--;
+        struct kp_header r = kp_get_header(next);
+        int n = kp_serve_one(p, r, next + hdr, reply + at,
+            size - at - count * hdr);
+        if(n == -1)
+        {
+            kp_set_header(reply + at, r.opcode, r.id, 0, -ENOSPC);
+            n = hdr;
+        }
+        at += n;
+    }
+    kp_set_header(reply, KP_BATCH, h.id, at - hdr, 0);
+    return(at);
+}
+
+/*
+** run kernel call request (len bytes) for p, whichever channel it came in
+** on: a binary message, or an ASCII call number and its argument. The
+** reply, if the call has one, goes in the size bytes at reply, and its
+** length is returned; a binary call that has blocked returns 0.
+*/
+int serve(PCB *p, const char *request, int len, char *reply, int size)
+{
+    if(len >= 1 && request[0] == KP_MAGIC)
+    {
+        return(kp_serve(p, request, len, reply, size));
+    }
+
+    // ASCII replies are read into 1 KB.
+    if(size > 1024)
+    {
+        size = 1024;
+    }
+    reply[0] = '\0';
+    if(len < 1)
+    {
+        return(0);
+    }
+
+    char kernel_call = request[0];
+    if (kernel_call == '1') {
+	snprintf(reply, size, "SYSTEM TIME: %d\n", sys_time);
+    }
+    if (kernel_call == '2') {
+	pcb_contents(p, reply);
+    }
+    if (kernel_call == '3') {
+	all_processes(processes, reply, size);
+    }
+    if (kernel_call == '4') {
+	assert(write(1, request + 1, len - 1)!= -1);
+	WRITES("\n");
+    }
+    return(strlen(reply));
+}
+
+/*
+** serve the kernel calls waiting on p's pipe, if it has made any. Returns
+** false if there was nothing to read.
+*/
+bool kernel_call(PCB *p)
+{
+    char request[2 * KP_MAX + 1];
+    char reply[KP_MAX];
+    if(p->child2parent[READ] == -1)
+    {
+        // not started yet, or already gone.
+        return(false);
+    }
+    int len = read(p->child2parent[READ], request, KP_MAX);
+    if(len <= 0)
+    {
+        return(false);
+    }
+
+    if(request[0] != KP_MAGIC)
+    {
+        // an ASCII call is whatever was read.
+        request[len] = '\0';
+        int n = serve(p, request, len, reply, sizeof(reply));
+        if(n > 0)
+        {
+            reply_to(p, reply, n);
+        }
+        return(true);
+    }
+
+    // binary messages: serve each whole one that was read. Each was
+    // written in one piece no bigger than PIPE_BUF, so if the read ended
+    // partway through the last, the rest of it is already in the pipe.
+    int off = 0;
+    while(off < len)
+    {
+        int have = len - off;
+        int want = sizeof(struct kp_header);
+        if(have >= want)
+        {
+            want = kp_message_len(request + off);
+        }
+        if(request[off] != KP_MAGIC || want < 0)
+        {
+            // lost track of the framing: say so, if there is a header to
+            // say it to, and drop the rest.
+            if(want < 0)
+            {
+                struct kp_header h = kp_get_header(request + off);
+                kp_set_header(reply, h.opcode, h.id, 0, KP_EPROTO);
+                reply_to(p, reply, sizeof(h));
+            }
+            break;
+        }
+        if(have < want)
+        {
+            int got = read(p->child2parent[READ], request + len, want - have);
+            if(got <= 0)
+            {
+                break;
+            }
+            len += got;
+            continue;
+        }
+
+        int n = serve(p, request + off, want, reply, sizeof(reply));
+        if(n > 0)
+        {
+            reply_to(p, reply, n);
+        }
+        off += want;
+    }
+    return(true);
+}
+
+/*
+** serve every kernel call waiting on p's request ring, in place: each
+** request is read from its slot and answered straight into a response
+** slot. Returns false if there were none.
+*/
+bool ring_calls(PCB *p)
+{
+    struct kc_region *kc = p->kc;
+    if(kc == NULL || p->pending_op != -1)
+    {
+        // the rest wait until its blocking call is done.
+        return(false);
+    }
+
+    // no more than a ringful, whatever the child has done to the indexes.
+    bool served = false;
+    struct kc_slot *request;
+    for(int i = 0; i < KC_SLOTS && (request = kc_peek(&kc->requests)) != NULL;
+        i++)
+    {
+        struct kc_slot *reply = kc_next_slot(&kc->responses);
+        if(reply == NULL)
+        {
+            break;
+        }
+        int len = (request->len > KC_DATA) ? KC_DATA : request->len;
+        reply->len = serve(p, request->data, len, reply->data, KC_DATA);
+        kc_pop(&kc->requests);
+        served = true;
+        if(p->pending_op != -1)
+        {
+            // it blocked; reply is left unpushed, kept for wake() to
+            // answer in.
+            p->pending_ring = true;
+            break;
+        }
+        kc_push(&kc->responses);
+    }
+    return(served);
+}
+
+/*
+** serve whatever p has waiting on either channel.
+*/
+void serve_calls(PCB *p)
+{
+    ring_calls(p);
+    kernel_call(p);
+}
+
+/*
+** a kernel call: serve the process that sent the SIGTRAP, found by its
+** pid rather than by reading every pipe. SIGTRAPs sent together merge
+** into one, so the processes running on the other CPUs are checked too;
+** nothing else can have made a call.
+*/
+void incoming_message(int signum)
+{
+    assert(signum == SIGTRAP);
+    WRITES("---- entering incoming_message\n");
+
+    PCB *caller = pid_find(&by_pid, trap_pid);
+    if(caller != NULL)
+    {
+        serve_calls(caller);
+    }
+    for(int i = 0; i < num_cpus; i++)
+    {
+        PCB *running = cpus[i].running;
+        if(running != cpus[i].idle && running != caller)
+        {
+            serve_calls(running);
+        }
+    }
+}
+
+
+
+void process_done(int signum)
+{
+    assert(signum == SIGCHLD);
+    WRITES("---- entering process_done\n");
+
+    // might have multiple children done; reap each by the pid that
+    // actually exited, whether or not it was running.
+    for(EVER)
+    {
+        siginfo_t info;
+
+        // we know we received a SIGCHLD so don't wait. Only peek, so the
+        // child can be reaped below with its rusage.
+        info.si_pid = 0;
+        if(waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == -1)
+        {
+            if(errno == ECHILD)
+            {
+                // every child, idle included, is gone.
+                break;
+            }
+            WRITES("waitid failed\n");
+            assertsyscall(kill(0, SIGTERM), != 0);
+        }
+        if(info.si_pid == 0)
+        {
+            // no more children.
+            break;
+        }
+
+        int status;
+        struct rusage usage;
+        long long exited = now_ns();
+        assertsyscall(wait4(info.si_pid, &status, 0, &usage), == info.si_pid);
+
+        PCB *done = pid_find(&by_pid, info.si_pid);
+        if(done == NULL)
+        {
+            WRITES("unknown child exited: ");
+            WRITEI(info.si_pid);
+            WRITES("\n");
+            continue;
+        }
+
+        pid_erase(&by_pid, done->pid);
+        CPU *cpu = &cpus[done->cpu];
+        bool was_running = (cpu->running == done);
+        close_channels(done);
+        kv_close(done);
+        km_release(done);
+        sched_exit(cpu, done);
+        done->status = status;
+        WRITES("process exited: ");
+        WRITES("\n");
+        cout << done;
+        int totaltime = sys_time - done->started;
+        WRITES("Total System Time = ");
+        WRITEI(totaltime);
+        WRITES("\n");
+
+        done->utime_us = usage.ru_utime.tv_sec * 1000000LL +
+            usage.ru_utime.tv_usec;
+        done->stime_us = usage.ru_stime.tv_sec * 1000000LL +
+            usage.ru_stime.tv_usec;
+        done->nvcsw = usage.ru_nvcsw;
+        done->nivcsw = usage.ru_nivcsw;
+        cout << "user time:    " << done->utime_us << " us" << endl;
+        cout << "system time:  " << done->stime_us << " us" << endl;
+        cout << "wall time:    " << (exited - done->started_ns) / 1000
+            << " us" << endl;
+        cout << "ready wait:   " << done->wait_ns / 1000 << " us" << endl;
+        cout << "voluntary switches:   " << done->nvcsw << endl;
+        cout << "involuntary switches: " << done->nivcsw << endl;
+
+        // whoever was waiting for it can run again.
+        // anyone still trying to send it a message gets EPIPE.
+        struct kp_exit e = exit_of(done);
+        bool woke = !rq_empty(&done->waiters);
+        while(!rq_empty(&done->waiters))
+        {
+            PCB *waiter = done->waiters.head;
+            if(waiter->pending_op == KP_SEND)
+            {
+                wake(waiter, -EPIPE, NULL, 0);
+            }
+            else
+            {
+                wake(waiter, 0, &e, sizeof(e));
+            }
+        }
+
+        // the rest of the time slice goes to whoever is next, or to the
+        // idle process, and an idle CPU a waiter woke on runs it now.
+        if(was_running)
+        {
+            dispatch(cpu, cpu->idle, sched_next(cpu));
+        }
+        for(int i = 0; woke && i < num_cpus; i++)
+        {
+            kick(&cpus[i]);
+        }
+    }
+    WRITES("---- leaving process_done\n");
+}
+
+
+/*
+** print the dispatch latency histograms.
+*/
+void dump_stats(__attribute__((unused)) int signum)
+{
+    WRITES("---- dispatch latency\n");
+    hist_print(1, "stop", &hist_stop);
+    hist_print(1, "decide", &hist_decide);
+    hist_print(1, "dispatch", &hist_dispatch);
+    hist_print(1, "total", &hist_total);
+    hist_print(1, "spawn", &hist_spawn);
+}
+
+/*
+** the clock has run out: report, then die of the SIGTERM as before.
+*/
+void shutdown(int signum)
+{
+    assert(signum == SIGTERM);
+    dump_stats(signum);
+
+    sigset_t term;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    signal(SIGTERM, SIG_DFL);
+    sigprocmask(SIG_UNBLOCK, &term, NULL);
+    raise(SIGTERM);
+}
+
+/*
+** set up the "hardware"
+*/
+void boot()
+{
+    sys_time = 0;
+    hist_init(&hist_stop);
+    hist_init(&hist_decide);
+    hist_init(&hist_dispatch);
+    hist_init(&hist_total);
+    hist_init(&hist_spawn);
+
+    ISV[SIGALRM] = scheduler; //ISV for SIGALRM sends to scheduler
+    ISV[SIGCHLD] = process_done;
+    ISV[SIGTRAP] = incoming_message;
+    ISV[SIGUSR1] = dump_stats;
+    ISV[SIGTERM] = shutdown;
+    struct sigaction *alarm = create_handler(SIGALRM, ISR); //create handler
+    struct sigaction *child = create_handler(SIGCHLD, ISR); //create handler
+    struct sigaction *trap = create_handler(SIGTRAP, ISR);
+    trap->sa_sigaction = trap_ISR;
+    trap->sa_flags |= SA_SIGINFO;
+    assert(sigaction(SIGTRAP, trap, NULL) == 0);
+    struct sigaction *usr1 = create_handler(SIGUSR1, ISR);
+    struct sigaction *term = create_handler(SIGTERM, ISR);
+
+    // a child that closes its end of the reply pipe costs it its replies
+    // (see reply_to()), not the kernel its life. Children get SIGPIPE
+    // back as they start.
+    signal(SIGPIPE, SIG_IGN);
+
+    // the event loop kernel runs its own clock.
+    if(event_kernel)
+    {
+        return;
+    }
+
+    // start up clock interrupt
+    int ret;
+    if((ret = fork()) == 0) //create a child
+    {
+        signal(SIGUSR1, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        send_signals(SIGALRM, getppid(), quantum,
+            (int)((long long)run_seconds * 1000000 / quantum));
+
+        // once that's done, cleanup and really kill everything...
+        delete(alarm);
+        delete(child);
+        delete(trap);
+        delete(usr1);
+        delete(term);
+        delete [] cpus;
+        kill(0, SIGTERM);
+    }
+
+    if(ret < 0)
+    {
+        perror("fork");
+    }
+}
+
+/*
+** The event loop kernel. Instead of running the kernel inside signal
+** handlers, the kernel's signals (SIGALRM, SIGCHLD, SIGTRAP, SIGUSR1 and
+** SIGTERM) stay blocked and are read from a signalfd, the clock is a
+** timerfd, and every child's request pipe and ring doorbell are watched
+** directly, all from one epoll loop. The ISV routines then run as ordinary code, so they are
+** free to allocate and use iostreams, and nothing is lost when signals
+** coalesce: process_done() reaps every child that has exited, and a
+** kernel call is served when its pipe becomes readable whether or not
+** its SIGTRAP got merged with another one.
+*/
+void event_loop()
+{
+    struct epoll_event ev;
+    assertsyscall(epfd = epoll_create1(EPOLL_CLOEXEC), != -1);
+
+    assertsyscall(sigfd = signalfd(-1, &kernel_signals,
+        SFD_NONBLOCK | SFD_CLOEXEC), != -1);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &sigfd;
+    assertsyscall(epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev), == 0);
+
+    tickfd = tick_timer(quantum);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &tickfd;
+    assertsyscall(epoll_ctl(epfd, EPOLL_CTL_ADD, tickfd, &ev), == 0);
+
+    long long ticks = 0;
+    long long number = (long long)run_seconds * 1000000 / quantum;
+
+    for(EVER)
+    {
+        struct epoll_event events[64];
+        int n = epoll_wait(epfd, events, 64, -1);
+        if(n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        assertsyscall(n, != -1);
+
+        for(int i = 0; i < n; i++)
+        {
+            if(events[i].data.ptr == &tickfd)
+            {
+                uint64_t expirations;
+                if(read(tickfd, &expirations, sizeof(expirations))
+                    != sizeof(expirations))
+                {
+                    continue;
+                }
+                ISR(SIGALRM);
+                ticks += expirations;
+                if(ticks >= number)
+                {
+                    kill(0, SIGTERM);
+                }
+            }
+            else if(events[i].data.ptr == &sigfd)
+            {
+                struct signalfd_siginfo info;
+                while(read(sigfd, &info, sizeof(info)) == sizeof(info))
+                {
+                    // SIGTRAPs only say a request is waiting; the pipes
+                    // themselves tell us which.
+                    if(info.ssi_signo != SIGTRAP)
+                    {
+                        ISR(info.ssi_signo);
+                    }
+                }
+            }
+            else if((uintptr_t)events[i].data.ptr & DOORBELL)
+            {
+                PCB *p = (PCB *)((uintptr_t)events[i].data.ptr & ~DOORBELL);
+                uint64_t rings;
+                if(read(p->kc_event, &rings, sizeof(rings)) == sizeof(rings))
+                {
+                    ring_calls(p);
+                }
+            }
+            else
+            {
+                PCB *p = (PCB *)events[i].data.ptr;
+                if(events[i].events & EPOLLIN)
+                {
+                    kernel_call(p);
+                }
+                else if(events[i].events & (EPOLLHUP | EPOLLERR))
+                {
+                    // its end of the pipe is gone: it has exited.
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, p->child2parent[READ],
+                        NULL);
+                }
+            }
+        }
+    }
+}
+
+void create_idle(CPU *cpu)
+{
+    PCB *idle = new PCB();
+    idle->state = READY;
+    idle->name = "IDLE";
+    idle->ppid = getpid();
+    idle->started = sys_time;
+    idle->child2parent[READ] = idle->child2parent[WRITE] = -1;
+    idle->parent2child[READ] = idle->parent2child[WRITE] = -1;
+    idle->kc_fd = -1;
+    idle->kc_event = -1;
+    idle->kv_slot = -1;
+    idle->cpu = cpu->id;
+    idle->started_ns = now_ns();
+    idle->pending_op = -1;
+    cpu->idle = idle;
+    cpu->running = idle;
+
+    if((idle->pid = fork()) == 0) //child
+    {
+        pin(0, cpu);
+        pause();
+        perror("pause in create_idle");
+    }
+}
+
+/*
+** set up num_cpus virtual CPUs, spread round robin over the real cores we
+** are allowed to run on.
+*/
+void create_cpus()
+{
+    cpu_set_t allowed;
+    assertsyscall(sched_getaffinity(0, sizeof(allowed), &allowed), == 0);
+    int cores[CPU_SETSIZE];
+    int num_cores = 0;
+    for(int core = 0; core < CPU_SETSIZE; core++)
+    {
+        if(CPU_ISSET(core, &allowed))
+        {
+            cores[num_cores++] = core;
+        }
+    }
+
+    cpus = new CPU[num_cpus];
+    for(int i = 0; i < num_cpus; i++)
+    {
+        CPU *cpu = &cpus[i];
+        cpu->id = i;
+        cpu->core = cores[i % num_cores];
+        cpu->min_vruntime = 0;
+        rq_init(&cpu->ready_queue);
+        rb_init(&cpu->cfs);
+        for(int level = 0; level < MLFQ_LEVELS; level++)
+        {
+            rq_init(&cpu->mlfq[level]);
+        }
+        create_idle(cpu);
+        cout << cpu->idle;
+    }
+}
+
+void usage(const char *me)
+{
+    fprintf(stderr, "usage: %s [-e] [-p rr|mlfq|cfs] [-b boost] [-c cpus]"
+        " [-m max] [-q usec] [-t seconds] [-s fork|spawn|zygote]"
+        " executable...\n", me);
+    fprintf(stderr, "  -e  run the kernel from an epoll loop, not signal"
+        " handlers\n");
+    fprintf(stderr, "  -p  scheduling policy (default rr)\n");
+    fprintf(stderr, "  -c  number of virtual CPUs (default 1)\n");
+    fprintf(stderr, "  -m  most processes live at once (default 0, no"
+        " limit)\n");
+    fprintf(stderr, "  -q  time quantum in microseconds (default %d)\n",
+        QUANTUM);
+    fprintf(stderr, "  -t  seconds to run before shutting down (default %d)\n",
+        NUM_SECONDS);
+    fprintf(stderr, "  -b  mlfq: ticks between priority boosts (default %d)\n",
+        MLFQ_BOOST);
+    fprintf(stderr, "  -s  how to start new processes (default fork)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while((opt = getopt(argc, argv, "+ep:b:c:m:q:t:s:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'p':
+            policy = NULL;
+            for(int i = 0; i < (int)(sizeof(policies) / sizeof(policies[0])); i++)
+            {
+                if(strcmp(optarg, policies[i].name) == 0)
+                {
+                    policy = &policies[i];
+                }
+            }
+            if(policy == NULL)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            if((mlfq_boost = strtol(optarg, NULL, 10)) < 1)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'e':
+            event_kernel = true;
+            break;
+        case 'c':
+            if((num_cpus = strtol(optarg, NULL, 10)) < 1)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'm':
+            if((max_live = strtol(optarg, NULL, 10)) < 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'q':
+            if((quantum = strtol(optarg, NULL, 10)) < 1)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            if((run_seconds = strtol(optarg, NULL, 10)) < 1)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            for(int i = 0; i <= SPAWN_ZYGOTE; i++)
+            {
+                if(strcmp(optarg, spawn_names[i]) == 0)
+                {
+                    spawn_method = (SPAWN)i;
+                    break;
+                }
+                if(i == SPAWN_ZYGOTE)
+                {
+                    usage(argv[0]);
+                }
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    // the zygote has to be forked while the kernel is still small.
+    if(spawn_method == SPAWN_ZYGOTE)
+    {
+        create_zygote();
+    }
+
+    rq_init(&new_queue);
+    tw_init(&sleepers, 0);
+    create_cpus();
+    create_vdso();
+    create_kmsg();
+
+    for (int i = optind; i < argc; i++) {
+	PCB *process;
+	process = new PCB();
+	process->state = NEW;
+	process->name = argv[i];
+	process->child2parent[READ] = process->child2parent[WRITE] = -1;
+	process->parent2child[READ] = process->parent2child[WRITE] = -1;
+	process->kc_fd = -1;
+	process->kc_event = -1;
+	process->kv_slot = -1;
+	process->processnumber = i - optind + 1;
+	process->cpu = -1;
+	process->ready_since = now_ns();
+	process->pending_op = -1;
+	process->mailbox = new km_mailbox();
+	processes.push_back(process);
+	rq_push_back(&new_queue, process);
+   	}
+
+    pid_init(&by_pid, processes.size());
+
+    // only start the clock once the CPUs and the process list are set up.
+    boot();
+
+    if(event_kernel)
+    {
+        sigemptyset(&kernel_signals);
+        sigaddset(&kernel_signals, SIGALRM);
+        sigaddset(&kernel_signals, SIGCHLD);
+        sigaddset(&kernel_signals, SIGTRAP);
+        sigaddset(&kernel_signals, SIGUSR1);
+        sigaddset(&kernel_signals, SIGTERM);
+        assertsyscall(sigprocmask(SIG_BLOCK, &kernel_signals, &user_mask), == 0);
+        event_loop();
+    }
 
     // we keep this process around so that the children don't die and
     // to keep the IRQs in place.
@@ -1,22 +1,82 @@
 //Author: Nick Barnes
 
+#include <dirent.h>
+#include <dlfcn.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#include "threadpool.h"
 
 /*
 ** Compile and run this program, and make sure you get the 'aargh' error
-** message. Fix it using a pthread mutex. The one command-line argument is
-** the number of times to loop. Here are some suggested initial values, but
-** you might have to tune them to your machine.
+** message. Fix it using a pthread mutex. The first command-line argument
+** is the number of times to loop. Here are some suggested initial values,
+** but you might have to tune them to your machine.
 ** Debian 8: 100000000
 ** Gouda: 10000000
 ** OS X: 100000
 ** You will need to compile your program with a "-lpthread" option.
+**
+** Give "-b" as the first argument,
+**
+** $ ./Race -b iterations [threads]
+**
+** and it is a contention benchmark instead: a pool of threads (see
+** threadpool.h) adds one to a shared count iterations times per thread,
+** split up between them by a parallel for, guarded each of these ways:
+**
+**   none      no guard at all, which loses counts
+**   mutex     a pthread mutex
+**   spinlock  a pthread spinlock
+**   ticket    a ticket lock, fair, first come first served
+**   atomic    std::atomic fetch_add
+**   sharded   a count per worker, each on its own cache line, added up at
+**             the end
+**
+** for 1, 2, 4, ... threads up to the number of hardware threads (or the
+** number given), and reports the adds per second and whether the final
+** count came out right. Needs -std=c++11. It exits 1 if any guard but
+** "none" got the count wrong.
+**
+** Don't ask for more threads than there are CPUs unless that is what you
+** want to measure: a spinning waiter then burns the slice its lock holder
+** needs, and the ticket lock, which can only hand over to the next in
+** line, collapses. Two threads on one CPU, 2000000 adds each:
+**
+**   mutex     51M/s    spinlock  66M/s    ticket    0.6M/s
+**   atomic   132M/s    sharded  651M/s
+**
+** Left to itself the OS puts the threads wherever it likes, which on a
+** machine with more than one socket makes runs hard to compare. Options,
+** after the -b:
+**
+**   -a compact   pin worker i to the i-th CPU counting socket by socket,
+**                core by core, so the threads fill one socket first
+**   -a scatter   pin them spread out: one core on each socket in turn,
+**                and only then a second hyperthread of any core
+**   -a 0,2,8-11  pin them to the CPUs listed, in that order
+**
+** Pinned, each worker's shard is put on its own CPU's NUMA node, with
+** libnuma if it is there (found at run time, so it isn't needed to build
+** or run; link with -ldl on older C libraries), and otherwise left to the
+** kernel. And with more than one socket, a pinned run ends by setting a
+** pair of threads on one socket against a pair on two, for the guards
+** whose count is shared, so what moving that cache line between sockets
+** costs can be read off directly.
 */
 
 #define NUM_THREADS 2
+#define MAX_THREADS 256
+#define MAX_CPUS 1024
+#define CACHE_LINE 64
 
 int i;
 
@@ -38,8 +98,659 @@ void *foo (void *bar)
     pthread_exit (me);
 }
 
+/*
+** The benchmark. Everything the threads share has a cache line to itself,
+** so what is measured is the guard and not false sharing with its
+** neighbours.
+*/
+
+static inline void cpu_relax ()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause ();
+#elif defined(__aarch64__)
+    asm volatile ("yield");
+#endif
+}
+
+struct alignas(CACHE_LINE) ticket_lock
+{
+    std::atomic<unsigned> next;
+    alignas(CACHE_LINE) std::atomic<unsigned> serving;
+};
+
+/*
+** Spin for our turn. A ticket lock hands the lock to the waiters strictly
+** in turn, so with more threads than CPUs a waiter that isn't running
+** holds up everyone behind it; give the CPU away now and then so that
+** case finishes at all.
+*/
+static void ticket_acquire (ticket_lock *lock)
+{
+    unsigned me = lock->next.fetch_add (1, std::memory_order_relaxed);
+    int spins = 0;
+    while (lock->serving.load (std::memory_order_acquire) != me)
+    {
+        cpu_relax ();
+        if (++spins % 64 == 0)
+        {
+            sched_yield ();
+        }
+    }
+}
+
+static void ticket_release (ticket_lock *lock)
+{
+    lock->serving.store (lock->serving.load (std::memory_order_relaxed) + 1,
+        std::memory_order_release);
+}
+
+enum strategy { NONE, MUTEX, SPINLOCK, TICKET, ATOMIC, SHARDED,
+    NUM_STRATEGIES };
+const char *strategy_names[] = { "none", "mutex", "spinlock", "ticket",
+    "atomic", "sharded" };
+
+struct alignas(CACHE_LINE) shard
+{
+    std::atomic<long> count;
+};
+
+alignas(CACHE_LINE) volatile long count;
+alignas(CACHE_LINE) std::atomic<long> atomic_count;
+alignas(CACHE_LINE) pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+alignas(CACHE_LINE) pthread_spinlock_t spinlock;
+ticket_lock ticket;
+shard *shards[MAX_THREADS];
+/*
+** add one to the count, guarded as how says, once for each iteration in
+** [lo, hi): the body of the parallel for.
+*/
+void add (strategy how, long lo, long hi)
+{
+    switch (how)
+    {
+    case NONE:
+        for (long j = lo; j < hi; j++)
+        {
+            count = count + 1;
+        }
+        break;
+    case MUTEX:
+        for (long j = lo; j < hi; j++)
+        {
+            pthread_mutex_lock (&mutex);
+            count = count + 1;
+            pthread_mutex_unlock (&mutex);
+        }
+        break;
+    case SPINLOCK:
+        for (long j = lo; j < hi; j++)
+        {
+            pthread_spin_lock (&spinlock);
+            count = count + 1;
+            pthread_spin_unlock (&spinlock);
+        }
+        break;
+    case TICKET:
+        for (long j = lo; j < hi; j++)
+        {
+            ticket_acquire (&ticket);
+            count = count + 1;
+            ticket_release (&ticket);
+        }
+        break;
+    case ATOMIC:
+        for (long j = lo; j < hi; j++)
+        {
+            atomic_count.fetch_add (1, std::memory_order_relaxed);
+        }
+        break;
+    case SHARDED:
+        {
+            // only this worker writes its shard, so no read-modify-write,
+            // but others may read it while it runs.
+            std::atomic<long> *mine = &shards[tp_self ()]->count;
+            for (long j = lo; j < hi; j++)
+            {
+                mine->store (mine->load (std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+double now ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+** one run: the pool's workers adding adds times between them. Returns the
+** final count and sets *seconds to how long the adding took.
+*/
+long run (tp_pool *pool, strategy how, long adds, double *seconds)
+{
+    count = 0;
+    atomic_count = 0;
+    ticket.next = 0;
+    ticket.serving = 0;
+    for (int t = 0; t < pool->n; t++)
+    {
+        shards[t]->count = 0;
+    }
+
+    double start = now ();
+    parallel_for (pool, 0, adds, [how] (long lo, long hi)
+    {
+        add (how, lo, hi);
+    });
+    *seconds = now () - start;
+
+    switch (how)
+    {
+    case ATOMIC:
+        return (atomic_count);
+    case SHARDED:
+        {
+            long total = 0;
+            for (int t = 0; t < pool->n; t++)
+            {
+                total += shards[t]->count;
+            }
+            return (total);
+        }
+    default:
+        return (count);
+    }
+}
+
+/*
+** Where the CPUs are, from /sys. thread is a CPU's place among the
+** hyperthreads of its core, and rank its core's place among the cores of
+** its socket.
+*/
+struct cpu_info
+{
+    int cpu;
+    int package;
+    int core;
+    int node;
+    int thread;
+    int rank;
+};
+
+cpu_info cpus[MAX_CPUS];
+int num_cpus;
+int num_packages;
+
+int read_sys (int cpu, const char *what)
+{
+    char path[128];
+    snprintf (path, sizeof (path), "/sys/devices/system/cpu/cpu%d/%s", cpu,
+        what);
+    FILE *f = fopen (path, "r");
+    int n = -1;
+    if (f != NULL)
+    {
+        if (fscanf (f, "%d", &n) != 1)
+        {
+            n = -1;
+        }
+        fclose (f);
+    }
+    return (n);
+}
+
+// the cpu's directory has a "nodeN" link to its node.
+int node_of (int cpu)
+{
+    char path[128];
+    snprintf (path, sizeof (path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir (path);
+    int node = -1;
+    if (dir != NULL)
+    {
+        struct dirent *d;
+        while ((d = readdir (dir)) != NULL)
+        {
+            if (sscanf (d->d_name, "node%d", &node) == 1)
+            {
+                break;
+            }
+            node = -1;
+        }
+        closedir (dir);
+    }
+    return (node);
+}
+
+/*
+** the CPUs we may run on.
+*/
+void topology ()
+{
+    cpu_set_t allowed;
+    CPU_ZERO (&allowed);
+    sched_getaffinity (0, sizeof (allowed), &allowed);
+    num_cpus = 0;
+    for (int c = 0; c < CPU_SETSIZE && num_cpus < MAX_CPUS; c++)
+    {
+        if (!CPU_ISSET (c, &allowed))
+        {
+            continue;
+        }
+        cpu_info *info = &cpus[num_cpus++];
+        info->cpu = c;
+        info->package = std::max (read_sys (c, "topology/physical_package_id"),
+            0);
+        info->core = read_sys (c, "topology/core_id");
+        if (info->core < 0)
+        {
+            info->core = c;
+        }
+        info->node = node_of (c);
+    }
+    num_packages = 0;
+    for (int i = 0; i < num_cpus; i++)
+    {
+        cpu_info *a = &cpus[i];
+        a->thread = 0;
+        a->rank = 0;
+        bool first = true;
+        for (int j = 0; j < num_cpus; j++)
+        {
+            cpu_info *b = &cpus[j];
+            if (b->package != a->package)
+            {
+                continue;
+            }
+            if (b->core == a->core && b->cpu < a->cpu)
+            {
+                a->thread++;
+            }
+            // count each other core once, by its lowest CPU.
+            if (b->core < a->core && b->thread == 0 && j < i)
+            {
+                a->rank++;
+            }
+            if (j < i)
+            {
+                first = false;
+            }
+        }
+        num_packages += first;
+    }
+}
+
+bool compact_order (const cpu_info &a, const cpu_info &b)
+{
+    if (a.package != b.package)
+    {
+        return (a.package < b.package);
+    }
+    if (a.core != b.core)
+    {
+        return (a.core < b.core);
+    }
+    return (a.cpu < b.cpu);
+}
+
+bool scatter_order (const cpu_info &a, const cpu_info &b)
+{
+    if (a.thread != b.thread)
+    {
+        return (a.thread < b.thread);
+    }
+    if (a.rank != b.rank)
+    {
+        return (a.rank < b.rank);
+    }
+    if (a.package != b.package)
+    {
+        return (a.package < b.package);
+    }
+    return (a.cpu < b.cpu);
+}
+
+/*
+** fill in the CPUs for n workers as placement says. Returns the number
+** of CPUs it names, or -1 if it makes no sense.
+*/
+int place (const char *placement, int n, int *out)
+{
+    cpu_info sorted[MAX_CPUS];
+    std::copy (cpus, cpus + num_cpus, sorted);
+    if (strcmp (placement, "compact") == 0 ||
+        strcmp (placement, "scatter") == 0)
+    {
+        std::sort (sorted, sorted + num_cpus,
+            placement[0] == 'c' ? compact_order : scatter_order);
+        // more workers than CPUs go round again.
+        for (int i = 0; i < n; i++)
+        {
+            out[i] = sorted[i % num_cpus].cpu;
+        }
+        return (num_cpus);
+    }
+
+    // a list: "0,2,8-11".
+    int count = 0;
+    const char *p = placement;
+    while (*p != '\0' && count < MAX_THREADS)
+    {
+        char *end;
+        long lo = strtol (p, &end, 10);
+        long hi = lo;
+        if (end == p || lo < 0 || lo >= CPU_SETSIZE)
+        {
+            return (-1);
+        }
+        if (*end == '-')
+        {
+            p = end + 1;
+            hi = strtol (p, &end, 10);
+            if (end == p || hi < lo || hi >= CPU_SETSIZE)
+            {
+                return (-1);
+            }
+        }
+        for (long c = lo; c <= hi && count < MAX_THREADS; c++)
+        {
+            out[count++] = c;
+        }
+        p = (*end == ',') ? end + 1 : end;
+        if (*end != ',' && *end != '\0')
+        {
+            return (-1);
+        }
+    }
+    if (count == 0)
+    {
+        return (-1);
+    }
+    for (int i = count; i < n; i++)
+    {
+        out[i] = out[i % count];
+    }
+    return (count);
+}
+
+/*
+** libnuma, if we can find it.
+*/
+struct
+{
+    bool loaded;
+    void *(*alloc_onnode) (size_t size, int node);
+    void (*free) (void *start, size_t size);
+} numa;
+
+void numa_load ()
+{
+    void *lib = dlopen ("libnuma.so.1", RTLD_NOW);
+    if (lib == NULL)
+    {
+        return;
+    }
+    int (*available) (void) = (int (*) (void)) dlsym (lib, "numa_available");
+    numa.alloc_onnode = (void *(*) (size_t, int)) dlsym (lib,
+        "numa_alloc_onnode");
+    numa.free = (void (*) (void *, size_t)) dlsym (lib, "numa_free");
+    numa.loaded = available != NULL && numa.alloc_onnode != NULL &&
+        numa.free != NULL && available () >= 0;
+}
+
+bool allowed (int cpu)
+{
+    for (int i = 0; i < num_cpus; i++)
+    {
+        if (cpus[i].cpu == cpu)
+        {
+            return (true);
+        }
+    }
+    return (false);
+}
+
+int cpu_node (int cpu)
+{
+    for (int i = 0; i < num_cpus; i++)
+    {
+        if (cpus[i].cpu == cpu)
+        {
+            return (cpus[i].node);
+        }
+    }
+    return (-1);
+}
+
+/*
+** a shard for each of n workers, on the node of the CPU it is pinned to
+** when we know where that is.
+*/
+bool on_node[MAX_THREADS];
+
+void make_shards (int n, const int *pinned)
+{
+    for (int t = 0; t < n; t++)
+    {
+        int node = pinned ? cpu_node (pinned[t]) : -1;
+        void *mem = NULL;
+        on_node[t] = numa.loaded && node >= 0 &&
+            (mem = numa.alloc_onnode (sizeof (shard), node)) != NULL;
+        if (!on_node[t] && posix_memalign (&mem, CACHE_LINE, sizeof (shard)))
+        {
+            perror ("posix_memalign");
+            exit (1);
+        }
+        shards[t] = new (mem) shard;
+    }
+}
+
+void free_shards (int n)
+{
+    for (int t = 0; t < n; t++)
+    {
+        if (on_node[t])
+        {
+            numa.free (shards[t], sizeof (shard));
+        }
+        else
+        {
+            free (shards[t]);
+        }
+    }
+}
+
+/*
+** for each guard whose count is shared, a pair of threads on two cores of
+** one socket against a pair on two sockets.
+*/
+int cross_socket (long iterations)
+{
+    cpu_info *a = &cpus[0];
+    cpu_info *near = NULL;
+    cpu_info *far = NULL;
+    for (int i = 1; i < num_cpus; i++)
+    {
+        cpu_info *b = &cpus[i];
+        if (b->package == a->package && b->core != a->core && near == NULL)
+        {
+            near = b;
+        }
+        if (b->package != a->package && far == NULL)
+        {
+            far = b;
+        }
+    }
+    if (near == NULL || far == NULL)
+    {
+        printf ("\nno two cores on one socket and another socket to compare\n");
+        return (0);
+    }
+
+    printf ("\ncpus %d and %d, one socket, against cpus %d and %d, two\n",
+        a->cpu, near->cpu, a->cpu, far->cpu);
+    printf ("%-9s %14s %14s  %s\n", "strategy", "one socket", "two sockets",
+        "slowdown");
+    int wrong = 0;
+    for (int s = MUTEX; s < NUM_STRATEGIES; s++)
+    {
+        double rate[2];
+        for (int pair = 0; pair < 2; pair++)
+        {
+            int pinned[2] = { a->cpu, pair ? far->cpu : near->cpu };
+            tp_pool *pool = tp_create (2, pinned);
+            if (pool == NULL)
+            {
+                perror ("pthread_create");
+                exit (1);
+            }
+            make_shards (2, pinned);
+            double seconds;
+            long got = run (pool, (strategy) s, 2 * iterations, &seconds);
+            wrong += (got != 2 * iterations);
+            rate[pair] = 2 * iterations / seconds;
+            free_shards (2);
+            tp_destroy (pool);
+        }
+        printf ("%-9s %14.0f %14.0f  %.2fx\n", strategy_names[s], rate[0],
+            rate[1], rate[0] / rate[1]);
+        fflush (stdout);
+    }
+    return (wrong);
+}
+
+int benchmark (long iterations, int max_threads, const char *placement)
+{
+    pthread_spin_init (&spinlock, PTHREAD_PROCESS_PRIVATE);
+
+    int pinned[MAX_THREADS];
+    if (placement != NULL)
+    {
+        place (placement, max_threads, pinned);
+        printf ("%s:", placement);
+        for (int t = 0; t < max_threads; t++)
+        {
+            printf (" %d", pinned[t]);
+        }
+        printf ("\nshards %s\n\n", numa.loaded ?
+            "on each worker's node, by libnuma" :
+            "where the kernel puts them: no libnuma");
+    }
+
+    printf ("%-9s %7s %14s %16s  %s\n", "strategy", "threads", "adds/s",
+        "count", "result");
+    int wrong = 0;
+    for (int threads = 1; ; threads *= 2)
+    {
+        if (threads > max_threads)
+        {
+            threads = max_threads;
+        }
+        // the threads are made once for all the strategies.
+        tp_pool *pool = tp_create (threads, placement ? pinned : NULL);
+        if (pool == NULL)
+        {
+            perror ("pthread_create");
+            exit (1);
+        }
+        make_shards (threads, placement ? pinned : NULL);
+        for (int s = 0; s < NUM_STRATEGIES; s++)
+        {
+            double seconds;
+            long expected = iterations * threads;
+            long got = run (pool, (strategy) s, expected, &seconds);
+            printf ("%-9s %7d %14.0f %16ld  ", strategy_names[s], threads,
+                expected / seconds, got);
+            if (got == expected)
+            {
+                printf ("ok\n");
+            }
+            else
+            {
+                printf ("WRONG: lost %ld\n", expected - got);
+                // losing counts is what "none" is there to show.
+                wrong += (s != NONE);
+            }
+            fflush (stdout);
+        }
+        free_shards (threads);
+        tp_destroy (pool);
+        if (threads == max_threads)
+        {
+            break;
+        }
+    }
+    if (placement != NULL)
+    {
+        wrong += cross_socket (iterations);
+    }
+    return (wrong ? 1 : 0);
+}
+
+int usage (const char *me)
+{
+    fprintf (stderr, "usage: %s -b [-a compact|scatter|cpu,cpu-cpu...]"
+        " iterations [threads, 1 to %d]\n", me, MAX_THREADS);
+    return (1);
+}
+
 int main(int argc, char **argv)
 {
+    if (argc >= 2 && strcmp (argv[1], "-b") == 0)
+    {
+        const char *placement = NULL;
+        int opt;
+        // argv[1], the -b, stands in for the program name.
+        while ((opt = getopt (argc - 1, argv + 1, "a:")) != -1)
+        {
+            if (opt != 'a')
+            {
+                return (usage (argv[0]));
+            }
+            placement = optarg;
+        }
+        char **args = argv + 1 + optind;
+        int nargs = argc - 1 - optind;
+        if (nargs < 1)
+        {
+            return (usage (argv[0]));
+        }
+        topology ();
+        numa_load ();
+        long iterations = strtol (args[0], NULL, 10);
+        int max_threads = (nargs >= 2) ? strtol (args[1], NULL, 10) :
+            num_cpus;
+        if (iterations < 1 || max_threads < 1 || max_threads > MAX_THREADS)
+        {
+            return (usage (argv[0]));
+        }
+        if (placement != NULL)
+        {
+            int pinned[MAX_THREADS];
+            if (place (placement, max_threads, pinned) < 0)
+            {
+                return (usage (argv[0]));
+            }
+            for (int t = 0; t < max_threads; t++)
+            {
+                if (!allowed (pinned[t]))
+                {
+                    fprintf (stderr, "%s: cpu %d isn't one we can run on\n",
+                        argv[0], pinned[t]);
+                    return (1);
+                }
+            }
+        }
+        return (benchmark (iterations, max_threads, placement));
+    }
+
     int iterations = strtol(argv[1], NULL, 10);
     pthread_t threads[NUM_THREADS];
 
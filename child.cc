@@ -2,15 +2,80 @@
 
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sched.h>
+#include <string.h>
 #include <errno.h>
 #include <stdlib.h>
 
+#include "sigbench.h"
+
 #define assertsyscall(x,y) if(x y){int err=errno; {perror(#x); exit(err);}}
 
-int main()
+/*
+** The signal benchmark's sender, run by main -b as
+**
+** child -b kill|flood|paced signal end count fd
+**
+** It sends its parent signal count times, with kill() or with sigqueue()
+** and the sequence number as payload, paced or not, then end with
+** sigqueue() and the count as payload. A sigqueue() that finds the
+** parent's queue full gets EAGAIN; rather than drop the signal it yields
+** and tries again, and counts the retries.
+*/
+int bench(char **argv)
+{
+	int ppid = getppid();
+	bool paced = strcmp(argv[2], "paced") == 0;
+	bool queue = paced || strcmp(argv[2], "flood") == 0;
+	int signo = atoi(argv[3]);
+	int end = atoi(argv[4]);
+	long count = atol(argv[5]);
+	int fd = atoi(argv[6]);
+
+	struct sig_shared *shm;
+	size_t size = sizeof(*shm) + count * sizeof(shm->send_ns[0]);
+	assertsyscall((shm = (struct sig_shared *)mmap(NULL, size,
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)),==MAP_FAILED);
+
+	shm->start_ns = sig_now();
+	for (long i = 0; i < count; i++) {
+		if (!queue) {
+			assertsyscall(kill(ppid, signo),<0);
+			continue;
+		}
+		while (paced && shm->acked < i) {
+			sched_yield();
+		}
+		union sigval value;
+		value.sival_int = i;
+		shm->send_ns[i] = sig_now();
+		while (sigqueue(ppid, signo, value) < 0) {
+			assertsyscall(errno,!=EAGAIN);
+			shm->full++;
+			sched_yield();
+		}
+	}
+	shm->end_ns = sig_now();
+	shm->sent = count;
+
+	union sigval value;
+	value.sival_int = count;
+	while (sigqueue(ppid, end, value) < 0) {
+		assertsyscall(errno,!=EAGAIN);
+		sched_yield();
+	}
+	return(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv)
 {
+	if (argc == 7 && strcmp(argv[1], "-b") == 0) {
+		exit(bench(argv));
+}
+
 	int ppid = getppid();
 	for (int i = 0; i < 3; i++) {
    		kill(ppid,SIGUSR1);
@@ -3,52 +3,65 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <signal.h>
-#include <errno.h>
 #include <stdlib.h>
-#include <assert.h>
-#include <fcntl.h>
-#include <string.h>
-#include <string>
-#include <iomanip>
-#include <locale>
-#include <sstream>
 
+#include "kcall.h"
 
-#define assertsyscall(x,y) if(x y){int err=errno; {perror(#x); exit(err);}}
-#define READ 0
-#define WRITE 1
+/*
+** A user process for CPU2: asks the kernel for the time, its own PCB and
+** the process list three times over, then says hello through it. The
+** calls go through kcall.h, which picks the transport.
+*/
 
-int main(int argc, char** argv)
+#define MAX_LIST 64
+
+int main(__attribute__((unused)) int argc,
+    __attribute__((unused)) char** argv)
 {
-	int pid = getpid();
-	for (int i = 1; i <= 3; ++i) {
-		 	std::ostringstream str1;
-	                str1 << i;
-	        	std::string temp = str1.str();
-			char *message = (char*)temp.c_str();
-        		assert(write(3, message, strlen(message))!= -1);
-			printf("\nIN CHILD: %d \n", pid);
-			kill(getppid(),SIGTRAP);
-			char buffer[1024];
-            		int len;
-            		len = read(4, buffer, sizeof (buffer));
-            		buffer[len] = 0;
-            		printf("%s\n", buffer);
-		
-	
-	}
-	char *message = (char*)"4Hello World!";
-        assert(write(3, message, strlen(message))!= -1);
-	printf("\nIN CHILD: %d \n", pid);
-	kill(getppid(),SIGTRAP);
-	char buffer[1024];
-        int len;
-        len = read(4, buffer, sizeof (buffer));
-        buffer[len] = 0;
-        printf("%s\n", buffer);
-		
-	exit(0);
-}
-	
+    int pid = getpid();
+    for(int i = 1; i <= 3; ++i)
+    {
+        printf("\nIN CHILD: %d \n", pid);
+
+        int now = kcall::time();
+        if(now < 0)
+        {
+            printf("time failed: %d\n", now);
+        }
+        else
+        {
+            printf("SYSTEM TIME: %d\n", now);
+        }
+
+        struct kp_pcb pcb;
+        if(kcall::pcb(&pcb) == 0)
+        {
+            printf("PCB REQUESTED:\nstate:       %d\npid:         %d\n"
+                "ppid:        %d\ninterrupts:  %d\nswitches:    %d\n"
+                "started:     %d\n", pcb.state, pcb.pid, pcb.ppid,
+                pcb.interrupts, pcb.switches, pcb.started);
+        }
 
+        struct kp_list_entry procs[MAX_LIST];
+        uint32_t total = 0;
+        int n = kcall::list(procs, MAX_LIST, 0, &total);
+        if(n >= 0)
+        {
+            printf("PROCESSES LIST (%d of %u):", n, total);
+            for(int j = 0; j < n; j++)
+            {
+                printf(" %s", procs[j].name);
+            }
+            printf("\n");
+        }
+    }
+
+    printf("\nIN CHILD: %d \n", pid);
+    int err = kcall::print("Hello World!\n");
+    if(err != 0)
+    {
+        printf("print failed: %d\n", err);
+    }
+
+    exit(0);
+}
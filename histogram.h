@@ -0,0 +1,178 @@
+// Author: Nick Barnes
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+** A log-linear (HDR-style) histogram of nanosecond latencies. Values are
+** bucketed by their highest set bit and then by the next HIST_SUB_BITS
+** bits below it, so every bucket is within 1/2^HIST_SUB_BITS (about 3%) of
+** the values in it, from 1 ns up to 2^64 ns, in a fixed 16 KB array.
+**
+** Recording is a handful of instructions with no allocation and no locks,
+** so it is safe to do from a signal handler. It is plain C so that the C
+** programs can use it as well as the C++ ones.
+*/
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct histogram
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+};
+
+static inline void hist_init(struct histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline int hist_bucket(uint64_t v)
+{
+    if(v < HIST_SUB)
+    {
+        return((int)v);
+    }
+    int top = 63 - __builtin_clzll(v);
+    int shift = top - HIST_SUB_BITS;
+    return((shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1)));
+}
+
+/*
+** the largest value that lands in bucket b.
+*/
+static inline uint64_t hist_value(int b)
+{
+    if(b < HIST_SUB)
+    {
+        return((uint64_t)b);
+    }
+    int shift = b / HIST_SUB - 1;
+    uint64_t sub = (uint64_t)(b % HIST_SUB) | HIST_SUB;
+    return(((sub + 1) << shift) - 1);
+}
+
+static inline void hist_record(struct histogram *h, uint64_t v)
+{
+    h->counts[hist_bucket(v)]++;
+    h->total++;
+    if(v < h->min)
+    {
+        h->min = v;
+    }
+    if(v > h->max)
+    {
+        h->max = v;
+    }
+}
+
+/*
+** the value at or below which fraction p (0 to 1) of the recorded values
+** fall, to within a bucket.
+*/
+static inline uint64_t hist_percentile(const struct histogram *h, double p)
+{
+    if(h->total == 0)
+    {
+        return(0);
+    }
+    uint64_t want = (uint64_t)(p * h->total);
+    if(want >= h->total)
+    {
+        want = h->total - 1;
+    }
+    uint64_t seen = 0;
+    for(int b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += h->counts[b];
+        if(seen > want)
+        {
+            uint64_t v = hist_value(b);
+            return(v > h->max ? h->max : v);
+        }
+    }
+    return(h->max);
+}
+
+/*
+** append s to line at *len, left justified in width and cut to fit in
+** HIST_NAME bytes.
+*/
+#define HIST_NAME 64
+
+static inline void hist_put_str(char *line, int *len, const char *s,
+    int width)
+{
+    int n = 0;
+    while(s[n] != '\0' && n < HIST_NAME)
+    {
+        line[(*len)++] = s[n++];
+    }
+    while(n++ < width)
+    {
+        line[(*len)++] = ' ';
+    }
+}
+
+/*
+** append v to line at *len in decimal, right justified in width, like
+** eye2eh() in CPU2.cc but for 64 bits: no stdio, so signal handlers can
+** use it.
+*/
+static inline void hist_put_u64(char *line, int *len, uint64_t v, int width)
+{
+    char digits[20];
+    int n = 0;
+    do
+    {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while(v != 0);
+    while(width-- > n)
+    {
+        line[(*len)++] = ' ';
+    }
+    while(n > 0)
+    {
+        line[(*len)++] = digits[--n];
+    }
+}
+
+/*
+** one line summarizing h, formatted by hand and written straight to fd
+** with write(2) so it can be done from a signal handler.
+*/
+static inline void hist_print(int fd, const char *name,
+    const struct histogram *h)
+{
+    char line[512];
+    int len = 0;
+    hist_put_str(line, &len, name, 12);
+    hist_put_str(line, &len, " n ", 0);
+    hist_put_u64(line, &len, h->total, 10);
+    hist_put_str(line, &len, "  min ", 0);
+    hist_put_u64(line, &len, h->total ? h->min : 0, 9);
+    hist_put_str(line, &len, "  p50 ", 0);
+    hist_put_u64(line, &len, hist_percentile(h, 0.50), 9);
+    hist_put_str(line, &len, "  p99 ", 0);
+    hist_put_u64(line, &len, hist_percentile(h, 0.99), 9);
+    hist_put_str(line, &len, "  p999 ", 0);
+    hist_put_u64(line, &len, hist_percentile(h, 0.999), 9);
+    hist_put_str(line, &len, "  max ", 0);
+    hist_put_u64(line, &len, h->max, 9);
+    hist_put_str(line, &len, " ns\n", 0);
+    ssize_t ignored = write(fd, line, len);
+    (void)ignored;
+}
+
+#endif
@@ -0,0 +1,550 @@
+// Author: Nick Barnes
+
+#ifndef KCALL_H
+#define KCALL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "kchannel.h"
+#include "kvdso.h"
+#include "kproto.h"
+#include "kmsg.h"
+
+/*
+** The client side of the kernel calls, for the programs CPU2 runs.
+**
+**  kcall::time()             ticks since boot
+**  kcall::pcb(&p)            the caller's PCB counters
+**  kcall::list(e, n)         the process list
+**  kcall::print(s)           write to the kernel's stdout
+**  kcall::yield(), sleep(ticks), wait(pid)
+**  kcall::alloc(), buffer(), send(), recv(), free()   messages (kmsg.h)
+**
+** Each returns 0 (or a count) on success and -errno on failure. A
+** kcall::batch collects requests and makes them in one kernel call,
+** synchronously with run() or asynchronously with submit() and wait().
+**
+** The caller never sees the transport. On first use it picks the fastest
+** the kernel has provided: the vDSO page for time() and pcb(), which
+** needs no call at all, then the shared-memory ring, then the pipes on
+** fds 3 and 4 with a SIGTRAP; avoid() turns the faster ones off.
+** Requests and responses are built in buffers set aside once per
+** process, so no call allocates; by the same token none of this is safe
+** to use from more than one thread or from a signal handler.
+*/
+
+namespace kcall
+{
+
+// the transports, fastest first.
+enum TRANSPORT { VDSO = 1, RING = 2, PIPE = 4 };
+
+struct CHANNEL
+{
+    bool attached;
+    int off;                    // TRANSPORTs not to use
+    struct kc_region *kc;       // the ring, or NULL to use the pipes
+    const struct kv_page *kv;   // the vDSO page, or NULL
+    char *pool;                 // the message buffer pool, or NULL
+    char request[KP_MAX];
+    char reply[KP_MAX];
+};
+
+static CHANNEL channel;
+
+inline CHANNEL *attach()
+{
+    if(!channel.attached)
+    {
+        channel.attached = true;
+        channel.kc = kc_attach();
+        channel.kv = kv_attach();
+        channel.pool = km_attach();
+    }
+    return(&channel);
+}
+
+/*
+** stop using the transports in mask, say to benchmark a slower one; 0
+** goes back to using the fastest. The pipes are always there.
+*/
+inline void avoid(int mask)
+{
+    attach()->off = mask & ~PIPE;
+}
+
+inline bool use_ring(CHANNEL *ch)
+{
+    return(ch->kc != NULL && !(ch->off & RING));
+}
+
+inline bool use_vdso(CHANNEL *ch)
+{
+    return(ch->kv != NULL && !(ch->off & VDSO));
+}
+
+/*
+** the pipes: all of buf, or false.
+*/
+inline bool write_all(int fd, const char *buf, int len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if(n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return(false);
+        }
+        buf += n;
+        len -= n;
+    }
+    return(true);
+}
+
+inline bool read_all(int fd, char *buf, int len)
+{
+    while(len > 0)
+    {
+        ssize_t n = read(fd, buf, len);
+        if(n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return(false);
+        }
+        buf += n;
+        len -= n;
+    }
+    return(true);
+}
+
+/*
+** send the message of len bytes at msg to the kernel without waiting for
+** the response. Returns 0, or -errno; -EAGAIN if KC_SLOTS messages are
+** already waiting for their responses on the ring.
+*/
+inline int send_message(const char *msg, int len)
+{
+    CHANNEL *ch = attach();
+    if(use_ring(ch))
+    {
+        struct kc_slot *s = kc_next_slot(&ch->kc->requests);
+        if(s == NULL)
+        {
+            return(-EAGAIN);
+        }
+        memcpy(s->data, msg, len);
+        s->len = len;
+        kc_push(&ch->kc->requests);
+        kc_notify(ch->kc);
+        return(0);
+    }
+    if(!write_all(3, msg, len))
+    {
+        return(-EIO);
+    }
+    kill(getppid(), SIGTRAP);
+    return(0);
+}
+
+/*
+** wait for the response to the oldest message sent and copy it into the
+** KP_MAX bytes at reply. Returns 0, or -errno.
+*/
+inline int receive_message(char *reply)
+{
+    CHANNEL *ch = attach();
+    if(use_ring(ch))
+    {
+        kc_wait(&ch->kc->responses);
+        struct kc_slot *r = kc_peek(&ch->kc->responses);
+        int len = (r->len > KP_MAX) ? KP_MAX : r->len;
+        memcpy(reply, r->data, len);
+        kc_pop(&ch->kc->responses);
+        return(len >= (int)sizeof(struct kp_header) ? 0 : -EPROTO);
+    }
+    int hdr = sizeof(struct kp_header);
+    if(!read_all(4, reply, hdr))
+    {
+        return(-EIO);
+    }
+    int len = kp_message_len(reply);
+    if(reply[0] != KP_MAGIC || len < 0)
+    {
+        return(-EPROTO);
+    }
+    return(read_all(4, reply + hdr, len - hdr) ? 0 : -EIO);
+}
+
+/*
+** make the one request op with its payload, and copy at most size bytes
+** of the response's payload to out. Returns the response's status.
+*/
+inline int request(uint16_t op, const void *payload, uint32_t plen,
+    void *out, uint32_t size)
+{
+    CHANNEL *ch = attach();
+    int len = kp_request(ch->request, op, 0, payload, plen);
+    if(len == -1)
+    {
+        return(-E2BIG);
+    }
+    int err;
+    if((err = send_message(ch->request, len)) != 0 ||
+        (err = receive_message(ch->reply)) != 0)
+    {
+        return(err);
+    }
+    struct kp_header h = kp_get_header(ch->reply);
+    if(out != NULL)
+    {
+        memcpy(out, ch->reply + sizeof(h), h.length < size ? h.length : size);
+    }
+    return(h.status);
+}
+
+inline int time(struct kp_time *t)
+{
+    CHANNEL *ch = attach();
+    if(use_vdso(ch))
+    {
+        uint32_t s;
+        do
+        {
+            s = kv_read_begin(&ch->kv->seq);
+            t->sys_time = ch->kv->sys_time;
+            t->quantum = ch->kv->quantum;
+            t->tick_ns = ch->kv->tick_ns;
+        } while(kv_read_retry(&ch->kv->seq, s));
+        return(0);
+    }
+    return(request(KP_TIME, NULL, 0, t, sizeof(*t)));
+}
+
+inline int time()
+{
+    struct kp_time t;
+    int err = time(&t);
+    return(err == 0 ? t.sys_time : err);
+}
+
+inline int pcb(struct kp_pcb *p)
+{
+    CHANNEL *ch = attach();
+    if(use_vdso(ch) && ch->kc != NULL && ch->kc->kv_slot != -1)
+    {
+        struct kv_pcb rec;
+        kv_pcb(ch->kv, ch->kc->kv_slot, &rec);
+        // until the kernel has published it, ask.
+        if(rec.pid != 0)
+        {
+            p->pid = rec.pid;
+            p->ppid = rec.ppid;
+            p->state = rec.state;
+            p->interrupts = rec.interrupts;
+            p->switches = rec.switches;
+            p->started = rec.started;
+            p->processnumber = rec.processnumber;
+            p->priority = rec.priority;
+            p->cpu = rec.cpu;
+            p->pad = 0;
+            p->cpu_ns = rec.cpu_ns;
+            p->wait_ns = rec.wait_ns;
+            return(0);
+        }
+    }
+    return(request(KP_PCB, NULL, 0, p, sizeof(*p)));
+}
+
+/*
+** up to max entries of the process list, starting from the first'th,
+** into entries. Returns how many, or -errno; *total, if given, is how
+** many processes there are.
+*/
+inline int list(struct kp_list_entry *entries, int max, uint32_t first = 0,
+    uint32_t *total = NULL)
+{
+    CHANNEL *ch = attach();
+    int n = 0;
+    while(n < max)
+    {
+        uint32_t from = first + n;
+        int err = request(KP_LIST, &from, sizeof(from), NULL, 0);
+        if(err != 0)
+        {
+            return(err);
+        }
+        struct kp_list l;
+        const char *body = ch->reply + sizeof(struct kp_header);
+        memcpy(&l, body, sizeof(l));
+        if(total != NULL)
+        {
+            *total = l.total;
+        }
+        uint32_t count = l.count;
+        if(count > (uint32_t)(max - n))
+        {
+            count = max - n;
+        }
+        memcpy(entries + n, body + sizeof(l), count * sizeof(*entries));
+        n += count;
+        if(count == 0 || from + l.count >= l.total)
+        {
+            break;
+        }
+    }
+    return(n);
+}
+
+inline int print(const char *s, int len)
+{
+    int most = KP_MAX - sizeof(struct kp_header);
+    for(int off = 0; off < len; off += most)
+    {
+        int n = (len - off < most) ? len - off : most;
+        int err = request(KP_PRINT, s + off, n, NULL, 0);
+        if(err != 0)
+        {
+            return(err);
+        }
+    }
+    return(0);
+}
+
+inline int print(const char *s)
+{
+    return(print(s, strlen(s)));
+}
+
+inline int yield()
+{
+    return(request(KP_YIELD, NULL, 0, NULL, 0));
+}
+
+/*
+** sleep for ticks clock ticks. Returns the tick it woke at, or -errno.
+*/
+inline int sleep(int ticks)
+{
+    int32_t n = ticks;
+    struct kp_time t;
+    int err = request(KP_SLEEP, &n, sizeof(n), &t, sizeof(t));
+    return(err == 0 ? t.sys_time : err);
+}
+
+/*
+** wait for process pid to exit; its exit, if e is given, goes in *e.
+*/
+inline int wait(int pid, struct kp_exit *e = NULL)
+{
+    int32_t p = pid;
+    return(request(KP_WAIT, &p, sizeof(p), e, e ? sizeof(*e) : 0));
+}
+
+/*
+** a message buffer: returns its number, to pass to buffer(), send() and
+** free(), or -errno.
+*/
+inline int alloc()
+{
+    struct kp_buf b;
+    int err = request(KP_ALLOC, NULL, 0, &b, sizeof(b));
+    return(err == 0 ? b.buf : err);
+}
+
+inline char *buffer(int buf)
+{
+    CHANNEL *ch = attach();
+    if(ch->pool == NULL || buf < 0 || buf >= KM_BUFS)
+    {
+        return(NULL);
+    }
+    return(km_buf(ch->pool, buf));
+}
+
+inline int free(int buf)
+{
+    int32_t b = buf;
+    return(request(KP_FREE, &b, sizeof(b), NULL, 0));
+}
+
+/*
+** hand the first len bytes of buf to process pid, waiting if its mailbox
+** is full. buf is no longer the caller's.
+*/
+inline int send(int pid, int buf, int len)
+{
+    struct kp_message m;
+    m.pid = pid;
+    m.buf = buf;
+    m.len = len;
+    m.pad = 0;
+    return(request(KP_SEND, &m, sizeof(m), NULL, 0));
+}
+
+/*
+** wait for a message; *m says who sent it and which buffer, now the
+** caller's, holds it.
+*/
+inline int recv(struct kp_message *m)
+{
+    return(request(KP_RECV, NULL, 0, m, sizeof(*m)));
+}
+
+/*
+** Requests made together, in one kernel call. Each add returns the
+** request's index, for status() and get(), or -1 if the batch is full.
+** run() makes the call and waits for it; submit() only sends it, so the
+** caller can get on with something else, and wait() collects the
+** responses. Responses come back in the order batches were submitted,
+** so wait for them in that order too, and have no more than KC_SLOTS
+** outstanding. Blocking calls can't be batched.
+*/
+class batch
+{
+public:
+    batch() : len(0), count(0)
+    {
+        kp_batch(msg, 0);
+        kp_batch(reply, 0);
+    }
+
+    void clear()
+    {
+        len = 0;
+        count = 0;
+        kp_batch(msg, 0);
+        kp_batch(reply, 0);
+    }
+
+    int time() { return(add(KP_TIME, NULL, 0)); }
+    int pcb() { return(add(KP_PCB, NULL, 0)); }
+    int list(uint32_t first = 0) { return(add(KP_LIST, &first, sizeof(first))); }
+    int print(const char *s, int n) { return(add(KP_PRINT, s, n)); }
+    int print(const char *s) { return(add(KP_PRINT, s, strlen(s))); }
+    int alloc() { return(add(KP_ALLOC, NULL, 0)); }
+    int free(int buf)
+    {
+        int32_t b = buf;
+        return(add(KP_FREE, &b, sizeof(b)));
+    }
+
+    int submit()
+    {
+        return(send_message(msg, len == 0 ? kp_batch(msg, 0) : len));
+    }
+
+    int wait()
+    {
+        return(receive_message(reply));
+    }
+
+    int run()
+    {
+        int err = submit();
+        return(err != 0 ? err : wait());
+    }
+
+    int size()
+    {
+        return(count);
+    }
+
+    /*
+    ** the status of request i once the batch has run; -ENOSPC means the
+    ** response didn't fit and it needs making again.
+    */
+    int status(int i)
+    {
+        struct kp_header h;
+        return(find(i, &h) != NULL ? h.status : -ENOENT);
+    }
+
+    /*
+    ** copy the response to request i into *out, and return its status.
+    */
+    template <class T>
+    int get(int i, T *out)
+    {
+        struct kp_header h;
+        const char *body = find(i, &h);
+        if(body == NULL)
+        {
+            return(-ENOENT);
+        }
+        memset(out, 0, sizeof(*out));
+        memcpy(out, body, h.length < sizeof(*out) ? h.length : sizeof(*out));
+        return(h.status);
+    }
+
+    /*
+    ** the entries of the list response to request i, as for kcall::list().
+    */
+    int entries(int i, struct kp_list_entry *out, int max)
+    {
+        struct kp_header h;
+        const char *body = find(i, &h);
+        if(body == NULL || h.status != 0 || h.length < sizeof(struct kp_list))
+        {
+            return(body == NULL ? -ENOENT : h.status);
+        }
+        struct kp_list l;
+        memcpy(&l, body, sizeof(l));
+        int n = ((int)l.count < max) ? (int)l.count : max;
+        memcpy(out, body + sizeof(l), n * sizeof(*out));
+        return(n);
+    }
+
+private:
+    int add(uint16_t op, const void *payload, uint32_t plen)
+    {
+        if(len == 0)
+        {
+            len = kp_batch(msg, 0);
+        }
+        int n = kp_add(msg, len, op, count, payload, plen);
+        if(n == -1)
+        {
+            return(-1);
+        }
+        len = n;
+        return(count++);
+    }
+
+    /*
+    ** response i's payload, with its header in *h, or NULL.
+    */
+    const char *find(int i, struct kp_header *h)
+    {
+        int off = 0;
+        const char *next;
+        while((next = kp_next(reply, &off)) != NULL)
+        {
+            *h = kp_get_header(next);
+            if(h->id == (uint32_t)i)
+            {
+                return(next + sizeof(*h));
+            }
+        }
+        return(NULL);
+    }
+
+    char msg[KP_MAX];
+    char reply[KP_MAX];
+    int len;
+    int count;
+};
+
+}
+
+#endif
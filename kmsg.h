@@ -0,0 +1,51 @@
+// Author: Nick Barnes
+
+#ifndef KMSG_H
+#define KMSG_H
+
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+** The message buffer pool. Messages between processes (KP_SEND and
+** KP_RECV in kproto.h) don't carry their payload through the kernel;
+** instead every child maps one pool of KM_BUFS buffers, and a message
+** just hands one of them over. The sender gets a buffer with KP_ALLOC,
+** fills it in place and sends its index; the receiver reads it in place
+** and then sends it on, say to the next stage of a pipeline, or gives it
+** back with KP_FREE. Nothing is copied at all.
+**
+** The kernel keeps track of who owns each buffer and only lets its owner
+** send or free it, but the pool is writable by every child, so ownership
+** is only as good as the children's manners. A child's buffers, and the
+** ones waiting in its mailbox, are freed when it exits.
+*/
+
+#define KM_FD 8             // the pool's memfd, in the child
+#define KM_BUFS 1024        // buffers in the pool
+#define KM_BUF 4096         // bytes in a buffer
+#define KM_SLOTS 16         // messages a mailbox holds before senders wait
+
+/*
+** in the child: map the pool the kernel left on KM_FD, or NULL if it
+** didn't leave one.
+*/
+static inline char *km_attach(void)
+{
+    void *pool = mmap(NULL, (size_t)KM_BUFS * KM_BUF, PROT_READ | PROT_WRITE,
+        MAP_SHARED, KM_FD, 0);
+    if(pool == MAP_FAILED)
+    {
+        return(NULL);
+    }
+    close(KM_FD);
+    return((char *)pool);
+}
+
+static inline char *km_buf(char *pool, int buf)
+{
+    return(pool + (size_t)buf * KM_BUF);
+}
+
+#endif
@@ -0,0 +1,237 @@
+// Author: Nick Barnes
+
+#ifndef KPROTO_H
+#define KPROTO_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+** The binary kernel-call protocol. A message is a kp_header followed by
+** length bytes of payload. The first byte is always KP_MAGIC, which no
+** ASCII call number is, so the kernel tells the two protocols apart by
+** it and child2's digits keep working.
+**
+** A message is either one request or a KP_BATCH, whose payload is any
+** number of requests back to back. The kernel answers a message with one
+** message: a batch gets a batch of responses, in the same order, each
+** carrying its request's opcode and id. A response's status is 0 or a
+** negative errno; its payload is one of the fixed-layout structs below.
+** If the responses to a batch won't all fit in KP_MAX, the ones that
+** don't fit come back with no payload and status -ENOSPC, to be sent
+** again.
+**
+** KP_YIELD, KP_SLEEP, KP_WAIT, KP_SEND and KP_RECV block: the caller is taken off the CPU
+** and its response only comes when it can run again. A blocking call has
+** to be sent on its own, not in a batch (-EINVAL), and a process has one
+** at a time; anything else it sends on its pipe meanwhile gets -EBUSY,
+** and anything on its ring waits for the blocking call to finish.
+**
+** A message is at most KP_MAX bytes, which is PIPE_BUF, so a message
+** written to a pipe in one write() arrives whole; the kernel reads
+** however many messages are waiting in one go.
+**
+** length comes from the other side, so it is never trusted: a message
+** claiming more than KP_MAX bytes in all is malformed (kp_message_len()
+** says -1), and the kernel answers it with KP_EPROTO and stops reading
+** that pipe's messages where it is, having lost track of where the next
+** one starts.
+*/
+
+#define KP_MAGIC 0x4b       // 'K'
+#define KP_VERSION 1
+#define KP_MAX 4096         // most bytes in a message, header included
+#define KP_EPROTO (-EPROTO) // status: a malformed message, or a bad version
+
+// opcodes
+#define KP_BATCH 0          // payload: requests; response: responses
+#define KP_TIME 1           // no payload; response: kp_time
+#define KP_PCB 2            // no payload; response: kp_pcb
+#define KP_LIST 3           // payload: uint32_t first; response: kp_list
+#define KP_PRINT 4          // payload: bytes for stdout; no response payload
+#define KP_YIELD 5          // no payload; no response payload
+#define KP_SLEEP 6          // payload: int32_t ticks; response: kp_time
+#define KP_WAIT 7           // payload: int32_t pid; response: kp_exit
+#define KP_ALLOC 8          // no payload; response: kp_buf
+#define KP_FREE 9           // payload: int32_t buf; no response payload
+#define KP_SEND 10          // payload: kp_message; no response payload
+#define KP_RECV 11          // no payload; response: kp_message
+
+struct kp_header
+{
+    uint8_t magic;          // KP_MAGIC
+    uint8_t version;        // KP_VERSION
+    uint16_t opcode;
+    uint32_t length;        // bytes of payload after the header
+    uint32_t id;            // the caller's, echoed in the response
+    int32_t status;         // responses only: 0 or -errno
+};
+
+struct kp_time
+{
+    int32_t sys_time;       // ticks since boot
+    int32_t quantum;        // microseconds per tick
+    int64_t tick_ns;        // CLOCK_MONOTONIC at the last tick
+};
+
+struct kp_pcb
+{
+    int32_t pid;
+    int32_t ppid;
+    int32_t state;
+    int32_t interrupts;
+    int32_t switches;
+    int32_t started;
+    int32_t processnumber;
+    int32_t priority;
+    int32_t cpu;
+    int32_t pad;
+    int64_t cpu_ns;
+    int64_t wait_ns;
+};
+
+// followed by count kp_list_entry, processes first to first + count - 1
+// of total; ask again from first + count for the rest.
+struct kp_list
+{
+    uint32_t total;
+    uint32_t first;
+    uint32_t count;
+    uint32_t pad;
+};
+
+struct kp_list_entry
+{
+    int32_t pid;            // 0 if not started yet
+    int32_t state;
+    int32_t processnumber;
+    int32_t pad;
+    char name[48];          // truncated, always terminated
+};
+
+struct kp_exit
+{
+    int32_t pid;
+    int32_t status;         // as from waitpid()
+    int64_t utime_us;
+    int64_t stime_us;
+};
+
+// a message buffer in the shared pool (see kmsg.h).
+struct kp_buf
+{
+    int32_t buf;
+    int32_t size;           // KM_BUF
+};
+
+struct kp_message
+{
+    int32_t pid;            // KP_SEND: to whom; KP_RECV: from whom
+    int32_t buf;            // the buffer holding it
+    int32_t len;            // bytes of the buffer used
+    int32_t pad;
+};
+
+static inline void kp_set_header(char *buf, uint16_t opcode, uint32_t id,
+    uint32_t length, int32_t status)
+{
+    struct kp_header h;
+    h.magic = KP_MAGIC;
+    h.version = KP_VERSION;
+    h.opcode = opcode;
+    h.length = length;
+    h.id = id;
+    h.status = status;
+    memcpy(buf, &h, sizeof(h));
+}
+
+static inline struct kp_header kp_get_header(const char *buf)
+{
+    struct kp_header h;
+    memcpy(&h, buf, sizeof(h));
+    return(h);
+}
+
+/*
+** the whole length of the message at buf, header included, or -1 if it
+** claims to be longer than KP_MAX.
+*/
+static inline int kp_message_len(const char *buf)
+{
+    uint32_t length = kp_get_header(buf).length;
+    if(length > KP_MAX - sizeof(struct kp_header))
+    {
+        return(-1);
+    }
+    return((int)(sizeof(struct kp_header) + length));
+}
+
+/*
+** write a message holding the one request into buf, which has room for
+** KP_MAX bytes. Returns its length, or -1 if it is too big.
+*/
+static inline int kp_request(char *buf, uint16_t opcode, uint32_t id,
+    const void *payload, uint32_t plen)
+{
+    if(sizeof(struct kp_header) + plen > KP_MAX)
+    {
+        return(-1);
+    }
+    kp_set_header(buf, opcode, id, plen, 0);
+    memcpy(buf + sizeof(struct kp_header), payload, plen);
+    return((int)(sizeof(struct kp_header) + plen));
+}
+
+/*
+** start a batch in buf. Returns its length so far.
+*/
+static inline int kp_batch(char *buf, uint32_t id)
+{
+    kp_set_header(buf, KP_BATCH, id, 0, 0);
+    return((int)sizeof(struct kp_header));
+}
+
+/*
+** add a request to the batch of len bytes in buf. Returns the new length,
+** or -1 if it won't fit in KP_MAX.
+*/
+static inline int kp_add(char *buf, int len, uint16_t opcode, uint32_t id,
+    const void *payload, uint32_t plen)
+{
+    if(len + sizeof(struct kp_header) + plen > KP_MAX)
+    {
+        return(-1);
+    }
+    kp_set_header(buf + len, opcode, id, plen, 0);
+    memcpy(buf + len + sizeof(struct kp_header), payload, plen);
+    len += sizeof(struct kp_header) + plen;
+    struct kp_header h = kp_get_header(buf);
+    kp_set_header(buf, KP_BATCH, h.id, len - sizeof(struct kp_header), 0);
+    return(len);
+}
+
+/*
+** step through the messages in the payload of the batch at buf: *off
+** starts at 0. Returns the next one, or NULL at the end or if the batch
+** is malformed. Every message is at least a header, so *off always moves
+** on.
+*/
+static inline const char *kp_next(const char *buf, int *off)
+{
+    int end = kp_message_len(buf);
+    int at = (int)sizeof(struct kp_header) + *off;
+    if(end < 0 || *off < 0 || at + (int)sizeof(struct kp_header) > end)
+    {
+        return(NULL);
+    }
+    int len = kp_message_len(buf + at);
+    if(len < 0 || at + len > end)
+    {
+        return(NULL);
+    }
+    *off += len;
+    return(buf + at);
+}
+
+#endif
@@ -0,0 +1,140 @@
+// Author: Nick Barnes
+
+#ifndef KVDSO_H
+#define KVDSO_H
+
+#include <stdint.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+** The kernel's "vDSO": one shared mapping the kernel writes and every
+** child it starts can only read, the way Linux serves clock_gettime()
+** without a syscall. It holds the system time, published at every tick,
+** and a table with one record per live process, published whenever the
+** scheduler changes that process's counters. A child reads the time or
+** its own record with no trap, no syscall and no copy through the kernel.
+**
+** Each record, and the time, is guarded by its own seqlock. The writer
+** makes seq odd, updates the fields and makes seq even again; a reader
+** copies the fields and retries if seq was odd or has changed.
+**
+** The kernel gives a process its record before starting it, and tells it
+** which one in its kc_region's kv_slot. If more than KV_PROCS processes
+** are live, the late ones have no record (kv_slot is -1) and have to use
+** kernel call '2' instead. pid is 0 until the kernel knows it.
+*/
+
+#define KV_FD 7             // the read-only mapping's fd, in the child
+#define KV_PROCS 4096       // records in the table
+
+struct kv_pcb
+{
+    uint32_t seq;
+    int32_t pid;
+    int32_t ppid;
+    int32_t state;
+    int32_t interrupts;
+    int32_t switches;
+    int32_t started;
+    int32_t processnumber;
+    int32_t priority;
+    int32_t cpu;
+    int64_t cpu_ns;
+    int64_t wait_ns;
+};
+
+struct kv_page
+{
+    uint32_t seq;
+    int32_t sys_time;       // ticks since boot
+    int64_t tick_ns;        // CLOCK_MONOTONIC at the last tick
+    int32_t quantum;        // microseconds per tick
+    char pad[44];
+    struct kv_pcb procs[KV_PROCS];
+};
+
+/*
+** writer: bracket every update to what seq guards.
+*/
+static inline void kv_write_begin(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void kv_write_end(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+** reader: kv_read_begin() waits out a write in progress; kv_read_retry()
+** is true if a write happened while reading, so the copy is torn.
+*/
+static inline uint32_t kv_read_begin(const uint32_t *seq)
+{
+    uint32_t s;
+    for(int spins = 0; ((s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1);
+        spins++)
+    {
+        // the kernel is a process too, and may have been preempted.
+        if(spins > 100)
+        {
+            sched_yield();
+        }
+    }
+    return(s);
+}
+
+static inline int kv_read_retry(const uint32_t *seq, uint32_t s)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return(__atomic_load_n(seq, __ATOMIC_RELAXED) != s);
+}
+
+/*
+** in the child: map the page the kernel left on KV_FD, or NULL if it
+** didn't leave one.
+*/
+static inline const struct kv_page *kv_attach(void)
+{
+    void *kv = mmap(NULL, sizeof(struct kv_page), PROT_READ, MAP_SHARED,
+        KV_FD, 0);
+    if(kv == MAP_FAILED)
+    {
+        return(NULL);
+    }
+    close(KV_FD);
+    return((const struct kv_page *)kv);
+}
+
+static inline int kv_time(const struct kv_page *kv)
+{
+    uint32_t s;
+    int t;
+    do
+    {
+        s = kv_read_begin(&kv->seq);
+        t = kv->sys_time;
+    } while(kv_read_retry(&kv->seq, s));
+    return(t);
+}
+
+/*
+** copy record slot into pcb.
+*/
+static inline void kv_pcb(const struct kv_page *kv, int slot,
+    struct kv_pcb *pcb)
+{
+    const struct kv_pcb *rec = &kv->procs[slot];
+    uint32_t s;
+    do
+    {
+        s = kv_read_begin(&rec->seq);
+        *pcb = *rec;
+    } while(kv_read_retry(&rec->seq, s));
+}
+
+#endif
@@ -1,5 +1,6 @@
 //Author: Nick Barnes 6/17/18
 
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,6 +12,12 @@
 #include <stddef.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+
+#include "histogram.h"
+#include "sigbench.h"
 
 #define assertsyscall(x,y) if(x y){int err=errno; {perror(#x); exit(err);}}
 #define nullptr NULL
@@ -27,8 +34,234 @@ void handler(int signo) {
 }
 }
 
-int main()
+/*
+** The signal benchmark: main -b [count]. Standard signals coalesce: any
+** number sent while one is pending are delivered as one, so the handler
+** above usually sees fewer SIGUSR1s than child sent. Real-time signals
+** queue instead, each with its own payload, up to RLIMIT_SIGPENDING.
+**
+** This has ./child send count signals each time: SIGUSR1 with kill(), to
+** count what coalescing loses, and then SIGRTMIN+1 with sigqueue() and a
+** sequence number as payload, as fast as it can ("flood") and one at a
+** time ("paced"). They are received each of these ways:
+**
+**   handler      an SA_SIGINFO handler, woken from sigsuspend()
+**   sigwaitinfo  blocked, and taken with sigwaitinfo()
+**   signalfd     blocked, and read from a signalfd, 64 at a time
+**
+** For each it reports how many were received and lost, how often the
+** child found the queue full and had to retry, the signals delivered per
+** second, from the first send to the last receive, and the latency from
+** each sigqueue() to its receipt. Flooded, the latency is mostly the wait
+** in the queue behind the others; paced, it is the cost of one delivery,
+** a context switch included on one CPU:
+**
+** $ ./main -b 100000
+** path        send       sent received    lost    full  signals/s   p50 ns   p99 ns   p999 ns    max ns
+** handler     kill     100000     8826   91174       0     246994
+** handler     flood    100000   100000       0      41     747521 27262975 31981567  32058797  32058797
+** sigwaitinfo flood    100000   100000       0       0    1056767  1212415  3997695   4194303   4202444
+** signalfd    flood    100000   100000       0       0    1099702   950271  3801087   3932159   3934073
+** handler     paced    100000   100000       0       0     392327     1567     1951      3455   1164238
+** sigwaitinfo paced    100000   100000       0       0     536012     1151     1535      3007    113154
+** signalfd    paced    100000   100000       0       0     536145     1151     1599      3007    177188
+**
+** So on one CPU a signal costs about 1.2us each way, switch and all, and
+** a handler a third more than taking it synchronously. CPU2.cc's kernel
+** pays that for every interrupt and kernel call. It exits 1 if any
+** real-time signal was lost.
+*/
+
+#define BENCH_COUNT 100000
+
+enum path { HANDLER, SIGWAITINFO, SIGNALFD };
+
+struct sig_shared *shm;
+struct histogram latency;
+volatile sig_atomic_t done;
+long received;
+long disorder;			// signals that didn't come in the order sent
+long next_seq;
+
+// one signal in, with sequence number seq if it has one.
+void got(long seq, int has_seq) {
+	received++;
+	if (!has_seq) {
+		return;
+}
+	hist_record(&latency, sig_now() - shm->send_ns[seq]);
+	shm->acked = seq + 1;
+	if (seq != next_seq) {
+		disorder++;
+}
+	next_seq = seq + 1;
+}
+
+void bench_handler(int signo, siginfo_t *info,
+	__attribute__((unused)) void *context) {
+	if (info->si_code == SI_QUEUE && signo != SIGRTMIN + 2) {
+		got(info->si_value.sival_int, 1);
+}
+	else if (signo == SIGRTMIN + 2) {
+		done = 1;
+}
+	else {
+		got(0, 0);
+}
+}
+
+/*
+** one run: count signals sent with kill() or sigqueue(), as send says,
+** taken the way path says. Prints a line of results, and returns the
+** signals lost.
+*/
+long bench_run(enum path path, const char *send, long count) {
+	int queue = strcmp(send, "kill") != 0;
+	int signo = queue ? SIGRTMIN + 1 : SIGUSR1;
+	int end = SIGRTMIN + 2;
+
+	size_t size = sizeof(*shm) + count * sizeof(shm->send_ns[0]);
+	int fd;
+	assertsyscall((fd = memfd_create("sigbench", 0)),<0);
+	assertsyscall(ftruncate(fd, size),<0);
+	assertsyscall((shm = (struct sig_shared *)mmap(NULL, size,
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)),==MAP_FAILED);
+	hist_init(&latency);
+	done = 0;
+	received = 0;
+	disorder = 0;
+	next_seq = 0;
+
+	// block the signals before the child can send any.
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, signo);
+	sigaddset(&set, end);
+	assert(sigprocmask(SIG_BLOCK, &set, &old)==0);
+	if (path == HANDLER) {
+		struct sigaction action;
+		action.sa_sigaction = bench_handler;
+		action.sa_mask = set;
+		action.sa_flags = SA_SIGINFO | SA_RESTART;
+		assert(sigaction(signo, &action, NULL)==0);
+		assert(sigaction(end, &action, NULL)==0);
+}
+	int sfd = -1;
+	if (path == SIGNALFD) {
+		assertsyscall((sfd = signalfd(-1, &set, 0)),<0);
+}
+
+	int cpid;
+	assertsyscall((cpid = fork()),<0);
+	if (cpid == 0) { //child
+		char args[4][32];
+		snprintf(args[0], sizeof(args[0]), "%d", signo);
+		snprintf(args[1], sizeof(args[1]), "%d", end);
+		snprintf(args[2], sizeof(args[2]), "%ld", count);
+		snprintf(args[3], sizeof(args[3]), "%d", fd);
+		assert(sigprocmask(SIG_SETMASK, &old, NULL)==0);
+		assertsyscall(execl("./child", "child", "-b", send, args[0], args[1], args[2], args[3], (char*)nullptr),<0);
+}
+
+	switch (path) {
+	case HANDLER:
+		while (!done) {
+			sigsuspend(&old);
+}
+		break;
+	case SIGWAITINFO:
+		while (!done) {
+			siginfo_t info;
+			int n = sigwaitinfo(&set, &info);
+			if (n == end) {
+				done = 1;
+}
+			else if (n == signo) {
+				got(info.si_value.sival_int, queue);
+}
+}
+		break;
+	case SIGNALFD:
+		while (!done) {
+			struct signalfd_siginfo infos[64];
+			ssize_t n = read(sfd, infos, sizeof(infos));
+			if (n < 0 && errno == EINTR) {
+				continue;
+}
+			assertsyscall(n,<0);
+			for (int i = 0; i < n / (ssize_t)sizeof(infos[0]); i++) {
+				if ((int)infos[i].ssi_signo == end) {
+					done = 1;
+}
+				else {
+					got(infos[i].ssi_int, queue);
+}
+}
+}
+		break;
+}
+	int64_t finish = sig_now();
+
+	int wstatus;
+	assertsyscall(waitpid(cpid, &wstatus, 0),<0);
+	if (sfd >= 0) {
+		close(sfd);
+}
+	signal(signo, SIG_DFL);
+	signal(end, SIG_DFL);
+	assert(sigprocmask(SIG_SETMASK, &old, NULL)==0);
+
+	const char *names[] = { "handler", "sigwaitinfo", "signalfd" };
+	long lost = shm->sent - received;
+	double seconds = (finish - shm->start_ns) / 1e9;
+	printf("%-11s %-6s %8ld %8ld %7ld %7ld %10.0f", names[path], send,
+		shm->sent, received, lost,
+		shm->full, received / seconds);
+	if (queue) {
+		printf(" %8llu %8llu %9llu %9llu",
+			(unsigned long long)hist_percentile(&latency, 0.50),
+			(unsigned long long)hist_percentile(&latency, 0.99),
+			(unsigned long long)hist_percentile(&latency, 0.999),
+			(unsigned long long)latency.max);
+		if (disorder != 0) {
+			printf("  %ld out of order", disorder);
+}
+}
+	printf("\n");
+	fflush(stdout);
+
+	assert(munmap(shm, size)==0);
+	close(fd);
+	return(queue ? lost : 0);
+}
+
+int bench(long count) {
+	printf("%-11s %-6s %8s %8s %7s %7s %10s %8s %8s %9s %9s\n", "path",
+		"send", "sent", "received", "lost", "full", "signals/s", "p50 ns",
+		"p99 ns", "p999 ns", "max ns");
+	long lost = 0;
+	bench_run(HANDLER, "kill", count);
+	for (int paced = 0; paced < 2; paced++) {
+		const char *send = paced ? "paced" : "flood";
+		lost += bench_run(HANDLER, send, count);
+		lost += bench_run(SIGWAITINFO, send, count);
+		lost += bench_run(SIGNALFD, send, count);
+}
+	// real-time signals should never be lost.
+	return(lost == 0 ? 0 : 1);
+}
+
+int main(int argc, char **argv)
 {
+	if (argc >= 2 && strcmp(argv[1], "-b") == 0) {
+		long count = argc >= 3 ? atol(argv[2]) : BENCH_COUNT;
+		if (count < 1 || count > 0x7fffffff) {
+			fprintf(stderr, "usage: %s -b [count]\n", argv[0]);
+			return(1);
+}
+		return(bench(count));
+}
+
 	struct sigaction action;
 	action.sa_handler = handler;
 	sigemptyset (&action.sa_mask);
@@ -4,16 +4,234 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
+#include <time.h>
+
+#include "histogram.h"
 
 #define assertsyscall(x,y) if((x)y){int err=errno; {perror(#x); exit(err);}}
 #define nullptr NULL
 
-int main()
+/*
+** The spawn benchmark: main -b [-n spawns] [-m MB,MB,...] [target args...]
+**
+** Starts target (by default ./counter with no arguments, which exits at
+** once) spawns times with each of
+**
+**   fork         fork() and execv() in the child
+**   vfork        vfork() and execv()
+**   posix_spawn  posix_spawn(), which glibc does with clone(CLONE_VFORK)
+**   clone        clone(CLONE_VM | CLONE_VFORK) and execv(), on a stack of
+**                our own
+**
+** waiting for each to exit before starting the next, and does it all
+** again with the parent's resident set grown by each of the sizes given
+** with -m (by default 0, 256 and 1024 MB), touched a page at a time so
+** that it is really there. For each it reports spawns per second and
+** percentiles of two latencies: "call", from the spawn call to its
+** return in the parent, and "total", to the child being reaped.
+**
+** fork has to copy the parent's page tables, so its call grows with the
+** resident set; the others share the parent's memory until the exec and
+** don't. On one CPU, ./counter as the target:
+**
+** $ ./main -b -n 1000
+**    MB method       spawns/s  call p50  call p99 total p50 total p99    max ns
+**     0 fork             1534     26623     79871    638975    966655   5264971
+**     0 vfork            1565     29695     63487    606207   1032191   4144749
+**     0 posix_spawn      1355     59391    770047    720895   1048575   2461940
+**     0 clone            1403     33791     86015    688127   1015807   3895476
+**   256 fork              309   1081343   2031615   3211263   5636095   9619015
+**   256 vfork            1693     28671     44031    573439    753663   1937648
+**   256 posix_spawn      1570     49151     81919    622591    917503   2153369
+**   256 clone            1603     30207     40959    622591    786431   2587263
+**  1024 fork              118   3473407   4849663   8388607  11010047  18925695
+**  1024 vfork            1775     27135     43007    557055    753663   1658602
+**  1024 posix_spawn      1703     46079    606207    573439    819199   2409230
+**  1024 clone            1779     27135     47103    540671    770047   5171369
+**
+** (With one CPU the vfork-style calls sometimes only return once the
+** child has run to its end, hence posix_spawn's call p99s.) A 1 GB
+** parent forks 13 times slower than an empty one; everything else stays
+** flat, which is why CPU2.cc's -s spawns with posix_spawn.
+*/
+
+#define BENCH_SPAWNS 2000
+#define CLONE_STACK (64 * 1024)
+
+extern char **environ;
+
+enum method { FORK, VFORK, POSIX_SPAWN, CLONE, NUM_METHODS };
+const char *method_names[] = { "fork", "vfork", "posix_spawn", "clone" };
+
+char **target;
+
+long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((long long)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+// the child of clone(): it shares our memory until the exec.
+int clone_child(__attribute__((unused)) void *arg)
+{
+	execv(target[0], target);
+	_exit(127);
+}
+
+/*
+** start target the way how says. Returns its pid.
+*/
+int spawn(enum method how, char *stack)
 {
+	int cpid = -1;
+	switch (how) {
+	case FORK:
+		assertsyscall(cpid = fork(),<0);
+		if (cpid == 0) {
+			execv(target[0], target);
+			_exit(127);
+}
+		break;
+	case VFORK:
+		assertsyscall(cpid = vfork(),<0);
+		if (cpid == 0) {
+			execv(target[0], target);
+			_exit(127);
+}
+		break;
+	case POSIX_SPAWN:
+		{
+			int err = posix_spawn(&cpid, target[0], NULL, NULL, target,
+				environ);
+			if (err != 0) {
+				errno = err;
+				perror("posix_spawn");
+				exit(err);
+}
+		}
+		break;
+	default:
+		assertsyscall(cpid = clone(clone_child, stack + CLONE_STACK,
+			CLONE_VM | CLONE_VFORK | SIGCHLD, NULL),<0);
+		break;
+}
+	return(cpid);
+}
+
+/*
+** spawn target spawns times with how, and print a line.
+*/
+int bench_method(enum method how, int spawns, long mb, char *stack)
+{
+	static struct histogram call, total;
+	hist_init(&call);
+	hist_init(&total);
+	int failed = 0;
+	long long start = now_ns();
+	for (int i = 0; i < spawns; i++) {
+		long long before = now_ns();
+		int cpid = spawn(how, stack);
+		long long returned = now_ns();
+		int wstatus;
+		assertsyscall(waitpid(cpid, &wstatus, 0),<0);
+		long long reaped = now_ns();
+		hist_record(&call, returned - before);
+		hist_record(&total, reaped - before);
+		failed += !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) == 127;
+}
+	double seconds = (now_ns() - start) / 1e9;
+	printf("%5ld %-11s %9.0f %9llu %9llu %9llu %9llu %9llu",
+		mb, method_names[how], spawns / seconds,
+		(unsigned long long)hist_percentile(&call, 0.50),
+		(unsigned long long)hist_percentile(&call, 0.99),
+		(unsigned long long)hist_percentile(&total, 0.50),
+		(unsigned long long)hist_percentile(&total, 0.99),
+		(unsigned long long)total.max);
+	if (failed != 0) {
+		printf("  %d failed", failed);
+}
+	printf("\n");
+	fflush(stdout);
+	return(failed);
+}
+
+void bench_usage(const char *me)
+{
+	fprintf(stderr, "usage: %s -b [-n spawns] [-m MB,MB,...]"
+		" [target args...]\n", me);
+	exit(1);
+}
+
+int bench(int argc, char **argv)
+{
+	int spawns = BENCH_SPAWNS;
+	const char *sizes = "0,256,1024";
+	int opt;
+	// argv[1], the -b, stands in for the program name.
+	while ((opt = getopt(argc - 1, argv + 1, "+n:m:")) != -1) {
+		if (opt == 'n' && (spawns = atoi(optarg)) > 0) {
+			continue;
+}
+		if (opt == 'm') {
+			sizes = optarg;
+			continue;
+}
+		bench_usage(argv[0]);
+}
+	static char *counter[] = { (char *)"./counter", nullptr };
+	target = (argc - 1 > optind) ? argv + 1 + optind : counter;
+
+	char *stack = (char *)malloc(CLONE_STACK);
+	printf("%5s %-11s %9s %9s %9s %9s %9s %9s\n", "MB", "method",
+		"spawns/s", "call p50", "call p99", "total p50", "total p99",
+		"max ns");
+
+	int failed = 0;
+	const char *p = sizes;
+	while (*p != '\0') {
+		char *end;
+		long mb = strtol(p, &end, 10);
+		if (end == p || mb < 0 || (*end != ',' && *end != '\0')) {
+			bench_usage(argv[0]);
+}
+		p = (*end == ',') ? end + 1 : end;
+
+		size_t size = (size_t)mb << 20;
+		char *rss = NULL;
+		if (size != 0) {
+			assertsyscall((rss = (char *)mmap(NULL, size,
+				PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+				-1, 0)),==MAP_FAILED);
+			for (size_t off = 0; off < size; off += 4096) {
+				rss[off] = 1;
+}
+}
+		for (int how = 0; how < NUM_METHODS; how++) {
+			failed += bench_method((enum method)how, spawns, mb, stack);
+}
+		if (rss != NULL) {
+			munmap(rss, size);
+}
+}
+	free(stack);
+	return(failed == 0 ? 0 : 1);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc >= 2 && strcmp(argv[1], "-b") == 0) {
+		return(bench(argc, argv));
+}
+
 	int cpid;
 	assertsyscall(cpid = fork(),<0);
 	if (cpid != 0){
@@ -29,5 +247,5 @@ int main()
 		int childReturn = WEXITSTATUS(wstatus);
 		std::cout << "Process " << cpid << " exited with status: " << childReturn << std::endl;
 }
-	
+
 }
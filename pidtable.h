@@ -0,0 +1,113 @@
+// Author: Nick Barnes
+
+#ifndef PIDTABLE_H
+#define PIDTABLE_H
+
+#include <stddef.h>
+
+/*
+** PCBs by pid: an open-addressed table with linear probing, allocated
+** once with at least twice as many slots as there will ever be PCBs in
+** it, so adding one from inside a signal handler never allocates and
+** never fills the table. Removing one shifts the rest of its run back
+** instead of leaving a tombstone.
+*/
+template <class T>
+struct PID_SLOT
+{
+    int pid;
+    T *pcb;     // NULL if the slot is free
+};
+
+template <class T>
+struct PIDTABLE
+{
+    PID_SLOT<T> *slots;
+    unsigned mask;
+};
+
+template <class T>
+void pid_init(PIDTABLE<T> *t, size_t n)
+{
+    size_t slots = 2;
+    while(slots < 2 * n)
+    {
+        slots *= 2;
+    }
+    t->slots = new PID_SLOT<T>[slots];
+    for(size_t i = 0; i < slots; i++)
+    {
+        t->slots[i].pid = 0;
+        t->slots[i].pcb = NULL;
+    }
+    t->mask = slots - 1;
+}
+
+template <class T>
+void pid_free(PIDTABLE<T> *t)
+{
+    delete [] t->slots;
+    t->slots = NULL;
+}
+
+template <class T>
+unsigned pid_hash(PIDTABLE<T> *t, int pid)
+{
+    return(((unsigned)pid * 2654435761u) & t->mask);
+}
+
+/*
+** the slot pid is in, or the free slot that ends its run.
+*/
+template <class T>
+unsigned pid_slot(PIDTABLE<T> *t, int pid)
+{
+    unsigned i = pid_hash(t, pid);
+    while(t->slots[i].pcb != NULL && t->slots[i].pid != pid)
+    {
+        i = (i + 1) & t->mask;
+    }
+    return(i);
+}
+
+template <class T>
+void pid_insert(PIDTABLE<T> *t, T *p)
+{
+    unsigned i = pid_slot(t, p->pid);
+    t->slots[i].pid = p->pid;
+    t->slots[i].pcb = p;
+}
+
+/*
+** the PCB with pid, or NULL if there isn't one.
+*/
+template <class T>
+T *pid_find(PIDTABLE<T> *t, int pid)
+{
+    return(t->slots[pid_slot(t, pid)].pcb);
+}
+
+template <class T>
+void pid_erase(PIDTABLE<T> *t, int pid)
+{
+    unsigned hole = pid_slot(t, pid);
+    if(t->slots[hole].pcb == NULL)
+    {
+        return;
+    }
+    for(unsigned i = (hole + 1) & t->mask; t->slots[i].pcb != NULL;
+        i = (i + 1) & t->mask)
+    {
+        // move i into the hole unless its home is between the two, where
+        // a lookup starting there would no longer reach it.
+        unsigned home = pid_hash(t, t->slots[i].pid);
+        if(((i - home) & t->mask) >= ((i - hole) & t->mask))
+        {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    t->slots[hole].pcb = NULL;
+}
+
+#endif
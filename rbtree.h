@@ -0,0 +1,359 @@
+// Author: Nick Barnes
+
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <assert.h>
+#include <stddef.h>
+
+/*
+** An intrusive red-black tree of PCBs, ordered by LESS. Like a RUNQUEUE
+** the links live in the PCB itself (rb_left, rb_right, rb_parent, rb_red
+** and tree), so inserting and removing are O(log n) and never allocate,
+** which keeps them safe to use from inside a signal handler. The least
+** PCB is cached, so finding it is O(1). A PCB is in at most one tree at a
+** time; tree is NULL when it is in none. LESS must be a strict order
+** under which no two PCBs are equal.
+*/
+template <class T, class LESS>
+struct RBTREE
+{
+    T *root;
+    T *first;   // the least PCB, NULL if empty
+    int count;
+};
+
+template <class T, class LESS>
+void rb_init(RBTREE<T, LESS> *t)
+{
+    t->root = NULL;
+    t->first = NULL;
+    t->count = 0;
+}
+
+template <class T, class LESS>
+bool rb_empty(RBTREE<T, LESS> *t)
+{
+    return(t->root == NULL);
+}
+
+template <class T>
+bool rb_is_red(T *p)
+{
+    return(p != NULL && p->rb_red);
+}
+
+/*
+** the PCB after p in the tree, or NULL if p is the last.
+*/
+template <class T>
+T *rb_next(T *p)
+{
+    if(p->rb_right != NULL)
+    {
+        p = p->rb_right;
+        while(p->rb_left != NULL)
+        {
+            p = p->rb_left;
+        }
+        return(p);
+    }
+    while(p->rb_parent != NULL && p == p->rb_parent->rb_right)
+    {
+        p = p->rb_parent;
+    }
+    return(p->rb_parent);
+}
+
+/*
+** put v where u is under u's parent.
+*/
+template <class T, class LESS>
+void rb_replace(RBTREE<T, LESS> *t, T *u, T *v)
+{
+    if(u->rb_parent == NULL)
+    {
+        t->root = v;
+    }
+    else if(u == u->rb_parent->rb_left)
+    {
+        u->rb_parent->rb_left = v;
+    }
+    else
+    {
+        u->rb_parent->rb_right = v;
+    }
+    if(v != NULL)
+    {
+        v->rb_parent = u->rb_parent;
+    }
+}
+
+template <class T, class LESS>
+void rb_rotate_left(RBTREE<T, LESS> *t, T *x)
+{
+    T *y = x->rb_right;
+    x->rb_right = y->rb_left;
+    if(y->rb_left != NULL)
+    {
+        y->rb_left->rb_parent = x;
+    }
+    rb_replace(t, x, y);
+    y->rb_left = x;
+    x->rb_parent = y;
+}
+
+template <class T, class LESS>
+void rb_rotate_right(RBTREE<T, LESS> *t, T *x)
+{
+    T *y = x->rb_left;
+    x->rb_left = y->rb_right;
+    if(y->rb_right != NULL)
+    {
+        y->rb_right->rb_parent = x;
+    }
+    rb_replace(t, x, y);
+    y->rb_right = x;
+    x->rb_parent = y;
+}
+
+template <class T, class LESS>
+void rb_insert(RBTREE<T, LESS> *t, T *p)
+{
+    assert(p->tree == NULL);
+    LESS less;
+    T *parent = NULL;
+    T **link = &t->root;
+    bool leftmost = true;
+    while(*link != NULL)
+    {
+        parent = *link;
+        if(less(p, parent))
+        {
+            link = &parent->rb_left;
+        }
+        else
+        {
+            link = &parent->rb_right;
+            leftmost = false;
+        }
+    }
+    p->rb_parent = parent;
+    p->rb_left = NULL;
+    p->rb_right = NULL;
+    p->rb_red = true;
+    *link = p;
+    if(leftmost)
+    {
+        t->first = p;
+    }
+    p->tree = t;
+    t->count++;
+
+    // p is red; while its parent is red too, push the red up the tree.
+    while(rb_is_red(p->rb_parent))
+    {
+        T *up = p->rb_parent;
+        T *grand = up->rb_parent;   // there is one: the root is black
+        if(up == grand->rb_left)
+        {
+            T *uncle = grand->rb_right;
+            if(rb_is_red(uncle))
+            {
+                up->rb_red = false;
+                uncle->rb_red = false;
+                grand->rb_red = true;
+                p = grand;
+                continue;
+            }
+            if(p == up->rb_right)
+            {
+                rb_rotate_left(t, up);
+                p = up;
+                up = p->rb_parent;
+            }
+            up->rb_red = false;
+            grand->rb_red = true;
+            rb_rotate_right(t, grand);
+        }
+        else
+        {
+            T *uncle = grand->rb_left;
+            if(rb_is_red(uncle))
+            {
+                up->rb_red = false;
+                uncle->rb_red = false;
+                grand->rb_red = true;
+                p = grand;
+                continue;
+            }
+            if(p == up->rb_left)
+            {
+                rb_rotate_right(t, up);
+                p = up;
+                up = p->rb_parent;
+            }
+            up->rb_red = false;
+            grand->rb_red = true;
+            rb_rotate_left(t, grand);
+        }
+    }
+    t->root->rb_red = false;
+}
+
+/*
+** x, which may be NULL, under parent, has one black too few on every path
+** through it: recolour and rotate until it hasn't.
+*/
+template <class T, class LESS>
+void rb_remove_fixup(RBTREE<T, LESS> *t, T *x, T *parent)
+{
+    while(x != t->root && !rb_is_red(x))
+    {
+        if(x == parent->rb_left)
+        {
+            T *w = parent->rb_right;
+            if(w->rb_red)
+            {
+                w->rb_red = false;
+                parent->rb_red = true;
+                rb_rotate_left(t, parent);
+                w = parent->rb_right;
+            }
+            if(!rb_is_red(w->rb_left) && !rb_is_red(w->rb_right))
+            {
+                w->rb_red = true;
+                x = parent;
+                parent = x->rb_parent;
+                continue;
+            }
+            if(!rb_is_red(w->rb_right))
+            {
+                w->rb_left->rb_red = false;
+                w->rb_red = true;
+                rb_rotate_right(t, w);
+                w = parent->rb_right;
+            }
+            w->rb_red = parent->rb_red;
+            parent->rb_red = false;
+            w->rb_right->rb_red = false;
+            rb_rotate_left(t, parent);
+        }
+        else
+        {
+            T *w = parent->rb_left;
+            if(w->rb_red)
+            {
+                w->rb_red = false;
+                parent->rb_red = true;
+                rb_rotate_right(t, parent);
+                w = parent->rb_left;
+            }
+            if(!rb_is_red(w->rb_left) && !rb_is_red(w->rb_right))
+            {
+                w->rb_red = true;
+                x = parent;
+                parent = x->rb_parent;
+                continue;
+            }
+            if(!rb_is_red(w->rb_left))
+            {
+                w->rb_right->rb_red = false;
+                w->rb_red = true;
+                rb_rotate_left(t, w);
+                w = parent->rb_left;
+            }
+            w->rb_red = parent->rb_red;
+            parent->rb_red = false;
+            w->rb_left->rb_red = false;
+            rb_rotate_right(t, parent);
+        }
+        x = t->root;
+    }
+    if(x != NULL)
+    {
+        x->rb_red = false;
+    }
+}
+
+/*
+** unlink p from t, wherever it is in the tree.
+*/
+template <class T, class LESS>
+void rb_remove(RBTREE<T, LESS> *t, T *p)
+{
+    assert(p->tree == t);
+    if(t->first == p)
+    {
+        t->first = rb_next(p);
+    }
+
+    bool black_removed = !p->rb_red;
+    T *x;           // what moves into the removed node's place
+    T *parent;      // and its new parent
+    if(p->rb_left == NULL)
+    {
+        x = p->rb_right;
+        parent = p->rb_parent;
+        rb_replace(t, p, x);
+    }
+    else if(p->rb_right == NULL)
+    {
+        x = p->rb_left;
+        parent = p->rb_parent;
+        rb_replace(t, p, x);
+    }
+    else
+    {
+        // p has two children: its successor y, which has no left child,
+        // takes its place and colour.
+        T *y = p->rb_right;
+        while(y->rb_left != NULL)
+        {
+            y = y->rb_left;
+        }
+        black_removed = !y->rb_red;
+        x = y->rb_right;
+        if(y->rb_parent == p)
+        {
+            parent = y;
+        }
+        else
+        {
+            parent = y->rb_parent;
+            rb_replace(t, y, x);
+            y->rb_right = p->rb_right;
+            y->rb_right->rb_parent = y;
+        }
+        rb_replace(t, p, y);
+        y->rb_left = p->rb_left;
+        y->rb_left->rb_parent = y;
+        y->rb_red = p->rb_red;
+    }
+    if(black_removed)
+    {
+        rb_remove_fixup(t, x, parent);
+    }
+
+    p->rb_left = NULL;
+    p->rb_right = NULL;
+    p->rb_parent = NULL;
+    p->tree = NULL;
+    t->count--;
+}
+
+/*
+** take the least PCB in t, or NULL if t is empty.
+*/
+template <class T, class LESS>
+T *rb_pop_first(RBTREE<T, LESS> *t)
+{
+    T *p = t->first;
+    if(p != NULL)
+    {
+        rb_remove(t, p);
+    }
+    return(p);
+}
+
+#endif
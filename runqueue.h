@@ -0,0 +1,119 @@
+// Author: Nick Barnes
+
+#ifndef RUNQUEUE_H
+#define RUNQUEUE_H
+
+#include <assert.h>
+#include <stddef.h>
+
+/*
+** An intrusive FIFO of PCBs. The links live in the PCB itself (next, prev
+** and queue), so pushing, popping and removing are all O(1) and never
+** allocate, which keeps them safe to use from inside a signal handler.
+** A PCB is on at most one queue at a time; queue is NULL when it is on
+** none.
+*/
+template <class T>
+struct RUNQUEUE
+{
+    T *head;
+    T *tail;
+    int count;
+};
+
+template <class T>
+void rq_init(RUNQUEUE<T> *q)
+{
+    q->head = NULL;
+    q->tail = NULL;
+    q->count = 0;
+}
+
+template <class T>
+bool rq_empty(RUNQUEUE<T> *q)
+{
+    return(q->head == NULL);
+}
+
+template <class T>
+void rq_push_back(RUNQUEUE<T> *q, T *p)
+{
+    assert(p->queue == NULL);
+    p->next = NULL;
+    p->prev = q->tail;
+    if(q->tail != NULL)
+    {
+        q->tail->next = p;
+    }
+    else
+    {
+        q->head = p;
+    }
+    q->tail = p;
+    p->queue = q;
+    q->count++;
+}
+
+template <class T>
+void rq_push_front(RUNQUEUE<T> *q, T *p)
+{
+    assert(p->queue == NULL);
+    p->prev = NULL;
+    p->next = q->head;
+    if(q->head != NULL)
+    {
+        q->head->prev = p;
+    }
+    else
+    {
+        q->tail = p;
+    }
+    q->head = p;
+    p->queue = q;
+    q->count++;
+}
+
+/*
+** unlink p from q, wherever it is in the queue.
+*/
+template <class T>
+void rq_remove(RUNQUEUE<T> *q, T *p)
+{
+    assert(p->queue == q);
+    if(p->prev != NULL)
+    {
+        p->prev->next = p->next;
+    }
+    else
+    {
+        q->head = p->next;
+    }
+    if(p->next != NULL)
+    {
+        p->next->prev = p->prev;
+    }
+    else
+    {
+        q->tail = p->prev;
+    }
+    p->next = NULL;
+    p->prev = NULL;
+    p->queue = NULL;
+    q->count--;
+}
+
+/*
+** take the PCB at the head of q, or NULL if q is empty.
+*/
+template <class T>
+T *rq_pop_front(RUNQUEUE<T> *q)
+{
+    T *p = q->head;
+    if(p != NULL)
+    {
+        rq_remove(q, p);
+    }
+    return(p);
+}
+
+#endif
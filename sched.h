@@ -0,0 +1,635 @@
+// Author: Nick Barnes
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "rbtree.h"
+#include "runqueue.h"
+#include "timerwheel.h"
+
+/*
+** The process model and the scheduling policies, shared by the kernel in
+** CPU2.cc and the discrete-event simulator in sim.cc. Nothing in here
+** forks, signals or reads a clock: the caller stops the running process
+** (state READY) at each tick, updates its cpu_ns, asks sched_decide() what
+** to run next and then makes that happen. Like runqueue.h, everything is
+** defined here, so include it from one source file per program.
+**
+** A process can also block: it goes WAITING, off every run queue, until
+** a timeout on the sleepers wheel expires or the process it is waiting
+** for exits, and sched_wake() puts it back on its CPU's run queue.
+*/
+
+#define MLFQ_LEVELS 4       // priority levels; level k gets a 2^k tick quantum
+#define MLFQ_BOOST 10       // ticks between priority boosts
+
+enum STATE { NEW, RUNNING, WAITING, READY, TERMINATED };
+
+struct VRUNTIME_LESS;
+
+struct PCB
+{
+    STATE state;
+    const char *name;   // name of the executable
+    int pid;            // process id from fork();
+    int ppid;           // parent process id
+    int interrupts;     // number of times interrupted
+    int switches;       // may be < interrupts
+    int started;        // the time this process started
+    int child2parent[2];
+    int parent2child[2];
+    struct kc_region *kc;   // shared kernel-call rings, NULL if none
+    int kc_fd;              // the memfd behind kc, until the child has it
+    int kc_event;           // the eventfd doorbell for kc, -1 if none
+    int kv_slot;            // its record in the vDSO page, -1 if none
+    int processnumber;
+    int priority;       // MLFQ level, 0 is the highest
+    int slice;          // ticks used of the current quantum
+    int cpu;            // the virtual CPU it last ran on
+    long long cpu_ns;   // nanoseconds of CPU used so far
+    long long vruntime; // CFS: nanoseconds of CPU charged, the tree's key
+    long long charged;  // CFS: the cpu_ns already added to vruntime
+    long long started_ns;   // wall clock when it was started
+    long long ready_since;  // wall clock when it last went on a run queue
+    long long wait_ns;      // total time spent waiting on a run queue
+    long long utime_us;     // user CPU time, from its rusage at exit
+    long long stime_us;     // system CPU time, from its rusage at exit
+    long nvcsw;             // voluntary context switches, ditto
+    long nivcsw;            // involuntary context switches, ditto
+    int status;             // its wait status, once TERMINATED
+    int wake_at;            // WAITING on sleepers: the tick to wake at
+    PCB *waiting_for;       // WAITING on this one's waiters, or NULL
+    RUNQUEUE<PCB> waiters;  // WAITING for this one to exit
+    int pending_op;         // the blocking kernel call it is in, or -1
+    unsigned pending_id;    // that call's id
+    bool pending_ring;      // that call came in on the ring, not the pipe,
+                            // and holds the next response slot
+    int pending_arg[3];     // that call's arguments, to finish it later
+    struct km_mailbox *mailbox; // messages sent to it, NULL if none
+    PCB *next;          // links for the NEW, READY or WAITING queue
+    PCB *prev;
+    RUNQUEUE<PCB> *queue; // the queue this PCB is on, NULL if none
+    PCB *rb_left;       // links for the CFS tree
+    PCB *rb_right;
+    PCB *rb_parent;
+    bool rb_red;
+    RBTREE<PCB, VRUNTIME_LESS> *tree; // the tree this PCB is in, NULL if none
+};
+
+// NEW processes waiting to be admitted, shared by all the CPUs. Admitted
+// processes wait on their CPU's run queues instead, and TERMINATED ones
+// are on no queue at all, so the scheduler never has to walk past them.
+RUNQUEUE<PCB> new_queue;
+
+// WAITING processes with a timeout, by the tick they wake at.
+TIMERWHEEL<PCB> sleepers;
+
+/*
+** orders the CFS tree by vruntime; the PCB's address breaks ties so that
+** every PCB is a distinct key.
+*/
+struct VRUNTIME_LESS
+{
+    bool operator()(const PCB *a, const PCB *b) const
+    {
+        if(a->vruntime != b->vruntime)
+        {
+            return(a->vruntime < b->vruntime);
+        }
+        return(a < b);
+    }
+};
+
+/*
+** A virtual CPU. Each one has its own running process, its own idle
+** process and its own run queues; in the kernel the real processes on it
+** are pinned to one real core. NEW processes wait on new_queue until a
+** policy admits them: rr onto the CPU that picks them, mlfq and cfs onto
+** the least loaded CPU (see least_loaded()).
+*/
+struct CPU
+{
+    int id;
+    int core;                           // real core to pin processes to
+    PCB *running;
+    PCB *idle;
+    RUNQUEUE<PCB> ready_queue;          // rr
+    RUNQUEUE<PCB> mlfq[MLFQ_LEVELS];    // mlfq, one queue per level
+    RBTREE<PCB, VRUNTIME_LESS> cfs;     // cfs, a red-black tree
+    long long min_vruntime;             // cfs, never goes backwards
+};
+
+CPU *cpus;
+int num_cpus = 1;
+
+int mlfq_boost = MLFQ_BOOST;
+
+int sys_time;
+
+int max_live = 0;   // most processes off new_queue at once, 0 for no limit
+int live;           // processes off new_queue and not yet TERMINATED
+
+/*
+** take the next NEW process off new_queue for a policy, unless max_live
+** processes are already live.
+*/
+PCB *admit()
+{
+    if(max_live > 0 && live >= max_live)
+    {
+        return(NULL);
+    }
+    PCB *p = rq_pop_front(&new_queue);
+    if(p != NULL)
+    {
+        live++;
+    }
+    return(p);
+}
+
+/*
+** A scheduling policy is a table of the operations scheduler() needs, the
+** same way ISV is a table of interrupt service routines. The policy owns
+** the READY processes of each CPU; NEW ones wait on new_queue until a
+** policy admit()s them.
+**
+**  enqueue  put a READY (or NEW) process on cpu's run queue
+**  pick     take the next process to run off cpu's run queue, NULL if none
+**  remove   take a process that terminated off cpu's run queue
+**  expired  true if the process running on cpu has to give up the CPU
+**  tick     per-tick housekeeping for cpu
+**  load     how many processes are waiting on cpu's run queue
+*/
+struct POLICY
+{
+    const char *name;
+    void (*enqueue)(CPU *, PCB *);
+    PCB *(*pick)(CPU *);
+    void (*remove)(CPU *, PCB *);
+    bool (*expired)(CPU *, PCB *);
+    void (*tick)(CPU *);
+    int (*load)(CPU *);
+};
+
+extern POLICY *policy;
+
+/*
+** the CPU with the fewest processes waiting, cpu itself if none has fewer,
+** to put a newly admitted process on so that a burst of NEW processes is
+** spread over the CPUs instead of all landing on whichever gets to them
+** first.
+*/
+CPU *least_loaded(CPU *cpu)
+{
+    CPU *best = cpu;
+    int fewest = policy->load(cpu);
+    for(int i = 0; i < num_cpus; i++)
+    {
+        int load = policy->load(&cpus[i]);
+        if(load < fewest)
+        {
+            best = &cpus[i];
+            fewest = load;
+        }
+    }
+    return(best);
+}
+
+void rq_remove_any(__attribute__((unused)) CPU *cpu, PCB *p)
+{
+    if(p->queue != NULL)
+    {
+        rq_remove(p->queue, p);
+    }
+}
+
+/*
+** round robin: a one tick quantum, and every NEW process runs before any
+** READY one.
+*/
+void rr_enqueue(CPU *cpu, PCB *p)
+{
+    rq_push_back(&cpu->ready_queue, p);
+}
+
+PCB *rr_pick(CPU *cpu)
+{
+    PCB *p;
+    if((p = admit()) != NULL)
+    {
+        return(p);
+    }
+    return(rq_pop_front(&cpu->ready_queue));
+}
+
+bool rr_expired(__attribute__((unused)) CPU *cpu,
+    __attribute__((unused)) PCB *p)
+{
+    return(true);
+}
+
+void rr_tick(__attribute__((unused)) CPU *cpu)
+{
+}
+
+int rr_load(CPU *cpu)
+{
+    return(cpu->ready_queue.count);
+}
+
+/*
+** multi-level feedback queue: NEW processes start at level 0 behind the
+** processes already there, a process that uses up its whole quantum drops
+** a level, and level k gets a quantum of 2^k ticks. A process only keeps
+** the CPU while nothing is waiting at a higher level. Every mlfq_boost
+** ticks everyone goes back to level 0 so CPU-bound jobs can't starve.
+*/
+int mlfq_quantum(PCB *p)
+{
+    return(1 << p->priority);
+}
+
+void mlfq_enqueue(CPU *cpu, PCB *p)
+{
+    if(p->state == NEW)
+    {
+        p->priority = 0;
+        p->slice = 0;
+    }
+    else if(p->slice >= mlfq_quantum(p))
+    {
+        if(p->priority < MLFQ_LEVELS - 1)
+        {
+            p->priority++;
+        }
+        p->slice = 0;
+    }
+    rq_push_back(&cpu->mlfq[p->priority], p);
+}
+
+/*
+** the highest level with anyone on it, after letting in the NEW processes
+** and spreading them over the CPUs.
+*/
+int mlfq_top(CPU *cpu)
+{
+    PCB *p;
+    while((p = admit()) != NULL)
+    {
+        mlfq_enqueue(least_loaded(cpu), p);
+    }
+    for(int level = 0; level < MLFQ_LEVELS; level++)
+    {
+        if(!rq_empty(&cpu->mlfq[level]))
+        {
+            return(level);
+        }
+    }
+    return(MLFQ_LEVELS);
+}
+
+PCB *mlfq_pick(CPU *cpu)
+{
+    int level = mlfq_top(cpu);
+    if(level == MLFQ_LEVELS)
+    {
+        return(NULL);
+    }
+    return(rq_pop_front(&cpu->mlfq[level]));
+}
+
+bool mlfq_expired(CPU *cpu, PCB *p)
+{
+    return(p->slice >= mlfq_quantum(p) || mlfq_top(cpu) < p->priority);
+}
+
+void mlfq_tick(CPU *cpu)
+{
+    if(sys_time % mlfq_boost != 0)
+    {
+        return;
+    }
+
+    for(int level = 1; level < MLFQ_LEVELS; level++)
+    {
+        PCB *p;
+        while((p = rq_pop_front(&cpu->mlfq[level])) != NULL)
+        {
+            p->priority = 0;
+            p->slice = 0;
+            rq_push_back(&cpu->mlfq[0], p);
+        }
+    }
+    cpu->running->priority = 0;
+    cpu->running->slice = 0;
+}
+
+int mlfq_load(CPU *cpu)
+{
+    int load = 0;
+    for(int level = 0; level < MLFQ_LEVELS; level++)
+    {
+        load += cpu->mlfq[level].count;
+    }
+    return(load);
+}
+
+/*
+** completely fair: each CPU keeps its READY processes in a red-black tree
+** ordered by vruntime, the CPU time (in nanoseconds) each process has
+** consumed, and always runs the one that has had the least. Picking is
+** O(log n). The running process keeps the CPU until someone waiting has
+** had less than it has. NEW processes, and processes coming back from
+** another CPU, start at the CPU's min_vruntime so they can't monopolise
+** it to catch up.
+*/
+
+void cfs_charge(PCB *p)
+{
+    if(p->cpu_ns > p->charged)
+    {
+        p->vruntime += p->cpu_ns - p->charged;
+        p->charged = p->cpu_ns;
+    }
+}
+
+/*
+** a process that has been waiting comes back at min_vruntime too, so
+** sleeping doesn't bank CPU time.
+*/
+void cfs_enqueue(CPU *cpu, PCB *p)
+{
+    cfs_charge(p);
+    if(p->vruntime < cpu->min_vruntime)
+    {
+        p->vruntime = cpu->min_vruntime;
+    }
+    rb_insert(&cpu->cfs, p);
+}
+
+void cfs_admit(CPU *cpu)
+{
+    PCB *p;
+    while((p = admit()) != NULL)
+    {
+        cfs_enqueue(least_loaded(cpu), p);
+    }
+}
+
+PCB *cfs_pick(CPU *cpu)
+{
+    cfs_admit(cpu);
+    PCB *p = rb_pop_first(&cpu->cfs);
+    if(p == NULL)
+    {
+        return(NULL);
+    }
+    if(p->vruntime > cpu->min_vruntime)
+    {
+        cpu->min_vruntime = p->vruntime;
+    }
+    return(p);
+}
+
+void cfs_remove(CPU *cpu, PCB *p)
+{
+    if(p->tree == &cpu->cfs)
+    {
+        rb_remove(&cpu->cfs, p);
+    }
+}
+
+bool cfs_expired(CPU *cpu, PCB *p)
+{
+    cfs_admit(cpu);
+    return(!rb_empty(&cpu->cfs) && cpu->cfs.first->vruntime < p->vruntime);
+}
+
+/*
+** charge the interrupted process for the CPU it used since the last tick.
+** Whoever drives the scheduler keeps cpu_ns up to date.
+*/
+void cfs_tick(CPU *cpu)
+{
+    PCB *p = cpu->running;
+    if(p == cpu->idle || p->state != READY)
+    {
+        return;
+    }
+    cfs_charge(p);
+}
+
+int cfs_load(CPU *cpu)
+{
+    return(cpu->cfs.count);
+}
+
+POLICY policies[] = {
+    { "rr", rr_enqueue, rr_pick, rq_remove_any, rr_expired, rr_tick,
+        rr_load },
+    { "mlfq", mlfq_enqueue, mlfq_pick, rq_remove_any, mlfq_expired,
+        mlfq_tick, mlfq_load },
+    { "cfs", cfs_enqueue, cfs_pick, cfs_remove, cfs_expired, cfs_tick,
+        cfs_load },
+};
+
+POLICY *policy = &policies[0];
+
+/*
+** an idle CPU takes the next process from the CPU with the most waiting.
+*/
+PCB *steal(CPU *cpu)
+{
+    CPU *victim = NULL;
+    int most = 0;
+    for(int i = 0; i < num_cpus; i++)
+    {
+        int load = policy->load(&cpus[i]);
+        if(&cpus[i] != cpu && load > most)
+        {
+            victim = &cpus[i];
+            most = load;
+        }
+    }
+    if(victim == NULL)
+    {
+        return(NULL);
+    }
+
+    return(policy->pick(victim));
+}
+
+/*
+** the next process to put on cpu, or NULL if there is nothing for it to
+** do.
+*/
+PCB *sched_next(CPU *cpu)
+{
+    PCB *torun = policy->pick(cpu);
+    if(torun == NULL)
+    {
+        torun = steal(cpu);
+    }
+    return(torun);
+}
+
+/*
+** decide what cpu runs for the next tick, once the caller has marked the
+** interrupted process READY. Returns cpu->running if it keeps the CPU, a
+** NEW process to start, a READY process to continue, or NULL if the CPU
+** has nothing to do and should run its idle process.
+*/
+PCB *sched_decide(CPU *cpu)
+{
+    PCB *running = cpu->running;
+
+    running->interrupts++;
+    running->slice++;
+    policy->tick(cpu);
+
+    if(running != cpu->idle && running->state == READY)
+    {
+        // let the interrupted process carry on if its quantum isn't up.
+        if(!policy->expired(cpu, running))
+        {
+            return(running);
+        }
+
+        // otherwise it goes back on the run queue. The idle process is
+        // never queued; it only runs when there is nothing else.
+        policy->enqueue(cpu, running);
+    }
+
+    return(sched_next(cpu));
+}
+
+/*
+** bookkeeping for putting p (NULL for the idle process) on cpu; the
+** caller still has to start or continue it.
+*/
+void sched_switch(CPU *cpu, PCB *p)
+{
+    PCB *running = cpu->running;
+    if(p == NULL)
+    {
+        p = cpu->idle;
+    }
+    else if(p->state == NEW)
+    {
+        p->interrupts = 0;
+        p->switches = 0;
+        p->started = sys_time;
+    }
+    else if(p != running)
+    {
+        running->switches++;
+    }
+    p->state = RUNNING;
+    p->cpu = cpu->id;
+    cpu->running = p;
+}
+
+/*
+** p, running on cpu, gives up the rest of its quantum: it goes back on
+** the run queue and whoever is next gets the CPU. Returns them, for the
+** caller to switch to, or NULL if that was p again and it carries on.
+*/
+PCB *sched_yield_cpu(CPU *cpu, PCB *p)
+{
+    p->state = READY;
+    policy->enqueue(cpu, p);
+    PCB *torun = sched_next(cpu);
+    if(torun == p)
+    {
+        p->state = RUNNING;
+        return(NULL);
+    }
+    return(torun);
+}
+
+/*
+** p, RUNNING on cpu or READY on its run queue, stops to wait. The caller
+** then puts it on sleepers or on a waiters queue, or leaves it for
+** whatever it is waiting for to sched_wake(), and if it was running
+** switches cpu to sched_next().
+*/
+void sched_block(CPU *cpu, PCB *p)
+{
+    policy->remove(cpu, p);
+    p->state = WAITING;
+}
+
+/*
+** block p, on cpu, until ticks from now.
+*/
+void sched_sleep(CPU *cpu, PCB *p, int ticks)
+{
+    sched_block(cpu, p);
+    p->wake_at = sys_time + ticks;
+    tw_add(&sleepers, p);
+}
+
+/*
+** block p, on cpu, until on exits.
+*/
+void sched_wait(CPU *cpu, PCB *p, PCB *on)
+{
+    sched_block(cpu, p);
+    p->waiting_for = on;
+    rq_push_back(&on->waiters, p);
+}
+
+/*
+** take WAITING p off whatever it is waiting on.
+*/
+void sched_unwait(PCB *p)
+{
+    if(p->waiting_for != NULL)
+    {
+        rq_remove(&p->waiting_for->waiters, p);
+        p->waiting_for = NULL;
+    }
+    else if(p->queue != NULL)
+    {
+        tw_cancel(&sleepers, p);
+    }
+}
+
+/*
+** WAITING p can run again: back on the run queue of the CPU it last ran
+** on.
+*/
+void sched_wake(PCB *p)
+{
+    sched_unwait(p);
+    p->state = READY;
+    policy->enqueue(&cpus[p->cpu], p);
+}
+
+/*
+** p, running on cpu, has exited; the idle process gets the rest of the
+** time slice.
+*/
+void sched_exit(CPU *cpu, PCB *p)
+{
+    if(p->state == WAITING)
+    {
+        sched_unwait(p);
+    }
+    else
+    {
+        policy->remove(cpu, p);
+    }
+    p->state = TERMINATED;
+    live--;
+    if(cpu->running == p)
+    {
+        cpu->running = cpu->idle;
+        cpu->idle->state = RUNNING;
+    }
+}
+
+#endif
@@ -0,0 +1,204 @@
+// Author: Nick Barnes
+
+#include <iostream>
+#include <list>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sched.h"
+
+/*
+** Measures the cost of one scheduler tick as the number of PCBs grows.
+**
+** "list" is the old scheduler(): rotate the whole processes list with
+** pop_front/push_back until a READY PCB turns up, walking past every
+** TERMINATED one on the way. The rest are the kernel's own scheduler, the
+** sched.h that CPU2.cc and sim.cc run, under each policy: each tick marks
+** the running process READY, charges it a quantum of CPU, and puts
+** whatever sched_decide() picks on the CPU with sched_switch(), the way
+** scheduler() does, less the signals.
+**
+** Each run has n PCBs of which only LIVE are still READY, the state the
+** list is in late in a run with a long job list. The optional argument is
+** the number of ticks to time for each n.
+**
+** $ ./sched_bench 2000
+**        n    list ns/tick      rr ns/tick    mlfq ns/tick     cfs ns/tick
+**       10            64.4             7.1             9.8            11.3
+**      100           646.4             7.3             9.8            11.8
+**     1000          6521.0             8.1             9.8            12.2
+**    10000         66762.6             7.7             9.8            11.7
+**   100000        638169.7             6.9             9.8            11.5
+*/
+
+#define LIVE 2
+#define QUANTUM_NS 1000000LL    // CPU charged to the running process a tick
+
+using namespace std;
+
+long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+/*
+** the PCBs that are still READY are spread evenly through the list.
+*/
+PCB *make_pcbs(int n)
+{
+    PCB *pcbs = new PCB[n]();
+    for(int i = 0; i < n; i++)
+    {
+        pcbs[i].state = (i % (n / LIVE) == 0) ? READY : TERMINATED;
+        pcbs[i].pid = i + 1;
+        pcbs[i].processnumber = i + 1;
+        pcbs[i].cpu = 0;
+    }
+    return(pcbs);
+}
+
+double time_list(int n, int ticks)
+{
+    PCB *pcbs = make_pcbs(n);
+    list<PCB *> processes;
+    for(int i = 0; i < n; i++)
+    {
+        processes.push_back(&pcbs[i]);
+    }
+    PCB *running = processes.front();
+    running->state = RUNNING;
+
+    long long start = now_ns();
+    for(int t = 0; t < ticks; t++)
+    {
+        running->state = READY;
+        for(int i = 0; i < (int)processes.size(); i++)
+        {
+            PCB *torun = processes.front();
+            processes.pop_front();
+            processes.push_back(torun);
+
+            if(torun->state == READY)
+            {
+                if(running->pid != torun->pid)
+                {
+                    running->switches++;
+                }
+                torun->state = RUNNING;
+                running = torun;
+                break;
+            }
+        }
+    }
+    double elapsed = now_ns() - start;
+
+    delete [] pcbs;
+    return(elapsed / ticks);
+}
+
+/*
+** one CPU, nothing on it yet but its idle process, under policy p.
+*/
+void reset(POLICY *p)
+{
+    policy = p;
+    sys_time = 0;
+    live = 0;
+    rq_init(&new_queue);
+    tw_init(&sleepers, 0);
+
+    CPU *cpu = &cpus[0];
+    cpu->id = 0;
+    cpu->core = 0;
+    cpu->min_vruntime = 0;
+    rq_init(&cpu->ready_queue);
+    rb_init(&cpu->cfs);
+    for(int level = 0; level < MLFQ_LEVELS; level++)
+    {
+        rq_init(&cpu->mlfq[level]);
+    }
+    cpu->idle->state = RUNNING;
+    cpu->running = cpu->idle;
+}
+
+double time_policy(POLICY *p, int n, int ticks)
+{
+    reset(p);
+    CPU *cpu = &cpus[0];
+    PCB *pcbs = make_pcbs(n);
+    for(int i = 0; i < n; i++)
+    {
+        if(pcbs[i].state == READY)
+        {
+            policy->enqueue(cpu, &pcbs[i]);
+        }
+    }
+    sched_switch(cpu, policy->pick(cpu));
+
+    long long start = now_ns();
+    for(int t = 0; t < ticks; t++)
+    {
+        sys_time++;
+        PCB *running = cpu->running;
+        running->state = READY;
+        running->cpu_ns += QUANTUM_NS;
+        sched_switch(cpu, sched_decide(cpu));
+    }
+    double elapsed = now_ns() - start;
+
+    delete [] pcbs;
+    return(elapsed / ticks);
+}
+
+void usage(const char *me)
+{
+    fprintf(stderr, "usage: %s [ticks]\n", me);
+    fprintf(stderr, "  ticks  ticks to time for each n, at least 1"
+        " (default 10000)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int ticks = 10000;
+    if(argc > 2)
+    {
+        usage(argv[0]);
+    }
+    if(argc == 2)
+    {
+        char *end;
+        long arg = strtol(argv[1], &end, 10);
+        if(end == argv[1] || *end != '\0' || arg < 1 || arg > 1000000000)
+        {
+            usage(argv[0]);
+        }
+        ticks = (int)arg;
+    }
+
+    cpus = new CPU[1];
+    num_cpus = 1;
+    cpus[0].idle = new PCB();
+    cpus[0].idle->name = "IDLE";
+
+    int num_policies = (int)(sizeof(policies) / sizeof(policies[0]));
+    printf("%8s %15s", "n", "list ns/tick");
+    for(int i = 0; i < num_policies; i++)
+    {
+        printf(" %7s ns/tick", policies[i].name);
+    }
+    printf("\n");
+    for(int n = 10; n <= 100000; n *= 10)
+    {
+        printf("%8d %15.1f", n, time_list(n, ticks));
+        for(int i = 0; i < num_policies; i++)
+        {
+            printf(" %15.1f", time_policy(&policies[i], n, ticks));
+        }
+        printf("\n");
+    }
+    return(0);
+}
@@ -0,0 +1,36 @@
+// Author: Nick Barnes
+
+#ifndef SIGBENCH_H
+#define SIGBENCH_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+** What main -b and child -b share for the signal benchmark: a memfd the
+** child maps from the fd number it is given. The child stamps each signal
+** with the time it sent it, by sequence number, and sigqueue()s the
+** number as the payload, so the receiver can look the time up and take
+** its latency. CLOCK_MONOTONIC is the same clock in both processes.
+** Paced, the child waits for the receiver to ack each signal before it
+** sends the next, so there is never a queue to wait in.
+*/
+
+struct sig_shared
+{
+	int64_t start_ns;		// the child's first send
+	int64_t end_ns;			// and its last
+	long sent;
+	long full;			// sigqueue()s that got EAGAIN and were retried
+	volatile long acked;		// signals received, when pacing
+	int64_t send_ns[];		// indexed by sequence number
+};
+
+static inline int64_t sig_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+#endif
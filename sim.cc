@@ -0,0 +1,557 @@
+// Author: Nick Barnes
+
+#include <iostream>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "sched.h"
+
+/*
+** A discrete-event simulation of the CPU2.cc kernel. It runs the same PCB,
+** state machine and scheduling policies (sched.h), but instead of forking
+** real processes and waiting for real SIGALRMs it keeps a virtual clock in
+** microseconds and an event queue, so a policy can be tried against a
+** million jobs in a few seconds.
+**
+** There are three kinds of events:
+**  ARRIVAL  a job shows up and goes on new_queue as a NEW process
+**  EXIT     the job running on a CPU has used up its burst; like
+**           process_done(), the CPU goes straight to whoever is next for
+**           the rest of the tick, or to its idle process
+**  TICK     the clock interrupt: every CPU stops its running process and
+**           asks sched_decide() what to run next, exactly like scheduler()
+**
+** While nothing is running or waiting the clock stops ticking and jumps to
+** the next arrival, lined up with the tick grid.
+**
+** The jobs come from a trace file with one job per line,
+**     arrival_usec burst_usec [name]
+** ('#' starts a comment), or are made up with -n: exponential interarrival
+** times with mean -a and exponential bursts with mean -B.
+**
+** $ ./sim -p mlfq -c 4 -q 1000 -n 1000000
+*/
+
+#define QUANTUM 1000        // microseconds per tick
+#define MEAN_ARRIVAL 1000   // -n: mean microseconds between arrivals
+#define MEAN_BURST 3000     // -n: mean microseconds of CPU per job
+
+using namespace std;
+
+// at the same time, EXITs go before ARRIVALs and ARRIVALs before TICKs.
+enum EVENT_TYPE { EXIT, ARRIVAL, TICK };
+
+struct EVENT
+{
+    long long time;
+    EVENT_TYPE type;
+    PCB *pcb;           // EXIT and ARRIVAL
+    int gen;            // EXIT: the job's gen when it was scheduled
+};
+
+struct EVENT_LATER
+{
+    bool operator()(const EVENT &a, const EVENT &b) const
+    {
+        if(a.time != b.time)
+        {
+            return(a.time > b.time);
+        }
+        return(a.type > b.type);
+    }
+};
+
+/*
+** what the simulator knows about a job beyond its PCB. pcb.processnumber
+** is the job's index in jobs.
+*/
+struct JOB
+{
+    PCB pcb;
+    const char *name;
+    long long arrival;
+    long long burst;
+    long long remaining;    // microseconds of CPU still needed
+    long long first_run;    // -1 until it first gets a CPU
+    long long finish;
+    long long dispatched;   // when it last got a CPU
+    int gen;                // bumped whenever it loses the CPU, so an EXIT
+                            // scheduled before that is ignored
+};
+
+vector<JOB> jobs;
+priority_queue<EVENT, vector<EVENT>, EVENT_LATER> events;
+long long now;
+int quantum = QUANTUM;
+bool ticking;
+
+JOB *job_of(PCB *p)
+{
+    return(&jobs[p->processnumber]);
+}
+
+void post(long long time, EVENT_TYPE type, PCB *pcb, int gen)
+{
+    EVENT e;
+    e.time = time;
+    e.type = type;
+    e.pcb = pcb;
+    e.gen = gen;
+    events.push(e);
+}
+
+/*
+** every field starts out zero or NULL, as if new PCB(), and the ones the
+** kernel means "none" by -1 are -1, so nothing in sched.h ever reads a
+** field the simulator forgot about.
+*/
+void init_pcb(PCB *p, const char *name, int number)
+{
+    *p = PCB();
+    p->state = NEW;
+    p->name = name;
+    p->child2parent[0] = p->child2parent[1] = -1;
+    p->parent2child[0] = p->parent2child[1] = -1;
+    p->kc_fd = -1;
+    p->kc_event = -1;
+    p->kv_slot = -1;
+    p->processnumber = number;
+    p->cpu = -1;
+    p->pending_op = -1;
+}
+
+/*
+** the clock interrupt stops whatever cpu is running and charges it for the
+** time it ran, the way ISR() and schedule_cpu() do in the kernel.
+*/
+void stop(CPU *cpu)
+{
+    PCB *p = cpu->running;
+    if(p == cpu->idle)
+    {
+        return;
+    }
+
+    JOB *job = job_of(p);
+    long long ran = now - job->dispatched;
+    job->remaining -= ran;
+    job->gen++;
+    p->cpu_ns += ran * 1000;
+    p->state = READY;
+}
+
+void dispatch(CPU *cpu, PCB *p)
+{
+    if(p != NULL && p->state == NEW)
+    {
+        p->pid = p->processnumber + 1;
+    }
+    sched_switch(cpu, p);
+    if(p == NULL)
+    {
+        return;
+    }
+
+    JOB *job = job_of(p);
+    if(job->first_run < 0)
+    {
+        job->first_run = now;
+    }
+    job->dispatched = now;
+    if(job->remaining <= quantum)
+    {
+        post(now + job->remaining, EXIT, p, job->gen);
+    }
+}
+
+/*
+** true while anything is running or waiting to run.
+*/
+bool busy()
+{
+    if(!rq_empty(&new_queue))
+    {
+        return(true);
+    }
+    for(int i = 0; i < num_cpus; i++)
+    {
+        if(cpus[i].running != cpus[i].idle || policy->load(&cpus[i]) > 0)
+        {
+            return(true);
+        }
+    }
+    return(false);
+}
+
+void tick()
+{
+    sys_time = (int)(now / quantum);
+    for(int i = 0; i < num_cpus; i++)
+    {
+        stop(&cpus[i]);
+    }
+    for(int i = 0; i < num_cpus; i++)
+    {
+        dispatch(&cpus[i], sched_decide(&cpus[i]));
+    }
+
+    ticking = busy();
+    if(ticking)
+    {
+        post(now + quantum, TICK, NULL, 0);
+    }
+}
+
+void arrival(PCB *p)
+{
+    rq_push_back(&new_queue, p);
+
+    int next = p->processnumber + 1;
+    if(next < (int)jobs.size())
+    {
+        post(jobs[next].arrival, ARRIVAL, &jobs[next].pcb, 0);
+    }
+
+    if(!ticking)
+    {
+        ticking = true;
+        post((now / quantum + 1) * quantum, TICK, NULL, 0);
+    }
+}
+
+void exited(PCB *p, int gen)
+{
+    JOB *job = job_of(p);
+    if(gen != job->gen || p->state != RUNNING)
+    {
+        // it lost the CPU before it could finish.
+        return;
+    }
+
+    job->remaining = 0;
+    job->finish = now;
+    p->cpu_ns += (now - job->dispatched) * 1000;
+    CPU *cpu = &cpus[p->cpu];
+    sched_exit(cpu, p);
+    dispatch(cpu, sched_next(cpu));
+}
+
+void read_trace(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if(f == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    char line[256];
+    int lineno = 0;
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if(hash != NULL)
+        {
+            *hash = '\0';
+        }
+
+        JOB job;
+        char name[64];
+        int n = sscanf(line, "%lld %lld %63s", &job.arrival, &job.burst, name);
+        if(n <= 0)
+        {
+            continue;
+        }
+        if(n < 2 || job.arrival < 0 || job.burst <= 0)
+        {
+            fprintf(stderr, "%s:%d: expected \"arrival_usec burst_usec "
+                "[name]\"\n", path, lineno);
+            exit(1);
+        }
+        job.name = (n == 3) ? strdup(name) : "job";
+        jobs.push_back(job);
+    }
+    fclose(f);
+}
+
+/*
+** exponentially distributed, with the given mean, at least 1.
+*/
+long long exponential(double mean)
+{
+    long long x = (long long)(-mean * log(1.0 - drand48()));
+    return(x < 1 ? 1 : x);
+}
+
+void make_jobs(int n, double mean_arrival, double mean_burst)
+{
+    jobs.reserve(n);
+    long long arrival = 0;
+    for(int i = 0; i < n; i++)
+    {
+        JOB job;
+        arrival += exponential(mean_arrival);
+        job.arrival = arrival;
+        job.burst = exponential(mean_burst);
+        job.name = "job";
+        jobs.push_back(job);
+    }
+}
+
+bool by_arrival(const JOB &a, const JOB &b)
+{
+    return(a.arrival < b.arrival);
+}
+
+/*
+** print the mean, median and 99th percentile of v, which gets reordered.
+*/
+void summarize(const char *what, vector<long long> &v)
+{
+    double sum = 0;
+    for(size_t i = 0; i < v.size(); i++)
+    {
+        sum += v[i];
+    }
+    size_t p50 = v.size() / 2;
+    size_t p99 = v.size() * 99 / 100;
+    nth_element(v.begin(), v.begin() + p50, v.end());
+    long long median = v[p50];
+    nth_element(v.begin(), v.begin() + p99, v.end());
+    printf("%-12s mean %.0f  p50 %lld  p99 %lld us\n", what, sum / v.size(),
+        median, v[p99]);
+}
+
+void report(long long events_run, double wall)
+{
+    vector<long long> turnaround, response, waiting;
+    long long switches = 0;
+    long long interrupts = 0;
+    long long makespan = 0;
+    for(size_t i = 0; i < jobs.size(); i++)
+    {
+        JOB *job = &jobs[i];
+        turnaround.push_back(job->finish - job->arrival);
+        response.push_back(job->first_run - job->arrival);
+        waiting.push_back(job->finish - job->arrival - job->burst);
+        switches += job->pcb.switches;
+        interrupts += job->pcb.interrupts;
+        makespan = max(makespan, job->finish);
+    }
+
+    printf("policy       %s\n", policy->name);
+    printf("cpus         %d\n", num_cpus);
+    printf("quantum      %d us\n", quantum);
+    printf("jobs         %zu\n", jobs.size());
+    printf("makespan     %lld us\n", makespan);
+    printf("throughput   %.1f jobs/s\n", jobs.size() * 1e6 / makespan);
+    summarize("turnaround", turnaround);
+    summarize("response", response);
+    summarize("waiting", waiting);
+    printf("interrupts   %lld\n", interrupts);
+    printf("switches     %lld\n", switches);
+    printf("events       %lld in %.2f s, %.0f events/s\n", events_run, wall,
+        events_run / wall);
+}
+
+void usage(const char *me)
+{
+    fprintf(stderr, "usage: %s [-p rr|mlfq|cfs] [-c cpus] [-q usec] [-b boost]"
+        " [-v] (trace | -n jobs [-a usec] [-B usec] [-s seed])\n", me);
+    fprintf(stderr, "  -p  scheduling policy (default rr)\n");
+    fprintf(stderr, "  -c  number of CPUs (default 1)\n");
+    fprintf(stderr, "  -q  time quantum in microseconds (default %d)\n",
+        QUANTUM);
+    fprintf(stderr, "  -b  mlfq: ticks between priority boosts (default %d)\n",
+        MLFQ_BOOST);
+    fprintf(stderr, "  -v  print every job as it is reported\n");
+    fprintf(stderr, "  -n  make up this many jobs instead of reading a trace\n");
+    fprintf(stderr, "  -a  -n: mean microseconds between arrivals (default %d)\n",
+        MEAN_ARRIVAL);
+    fprintf(stderr, "  -B  -n: mean microseconds of CPU per job (default %d)\n",
+        MEAN_BURST);
+    fprintf(stderr, "  -s  -n: random seed (default 1)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int n = 0;
+    double mean_arrival = MEAN_ARRIVAL;
+    double mean_burst = MEAN_BURST;
+    char *rest;
+    long seed = 1;
+    bool verbose = false;
+    while((opt = getopt(argc, argv, "p:c:q:b:vn:a:B:s:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'p':
+            policy = NULL;
+            for(int i = 0; i < (int)(sizeof(policies) / sizeof(policies[0])); i++)
+            {
+                if(strcmp(optarg, policies[i].name) == 0)
+                {
+                    policy = &policies[i];
+                }
+            }
+            if(policy == NULL)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            if((num_cpus = strtol(optarg, NULL, 10)) < 1)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'q':
+            if((quantum = strtol(optarg, NULL, 10)) < 1)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            if((mlfq_boost = strtol(optarg, NULL, 10)) < 1)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'n':
+            if((n = strtol(optarg, NULL, 10)) < 1)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'a':
+            mean_arrival = strtod(optarg, &rest);
+            if(*rest != '\0' || !(mean_arrival > 0) || isinf(mean_arrival))
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'B':
+            mean_burst = strtod(optarg, &rest);
+            if(*rest != '\0' || !(mean_burst > 0) || isinf(mean_burst))
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            seed = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if(n > 0 && optind == argc)
+    {
+        srand48(seed);
+        make_jobs(n, mean_arrival, mean_burst);
+    }
+    else if(n == 0 && optind == argc - 1)
+    {
+        read_trace(argv[optind]);
+        stable_sort(jobs.begin(), jobs.end(), by_arrival);
+    }
+    else
+    {
+        usage(argv[0]);
+    }
+    if(jobs.empty())
+    {
+        fprintf(stderr, "no jobs\n");
+        return(1);
+    }
+
+    for(size_t i = 0; i < jobs.size(); i++)
+    {
+        JOB *job = &jobs[i];
+        init_pcb(&job->pcb, job->name, (int)i);
+        job->remaining = job->burst;
+        job->first_run = -1;
+        job->finish = -1;
+        job->dispatched = 0;
+        job->gen = 0;
+    }
+
+    rq_init(&new_queue);
+    cpus = new CPU[num_cpus];
+    for(int i = 0; i < num_cpus; i++)
+    {
+        CPU *cpu = &cpus[i];
+        cpu->id = i;
+        cpu->core = i;
+        cpu->min_vruntime = 0;
+        rq_init(&cpu->ready_queue);
+        rb_init(&cpu->cfs);
+        for(int level = 0; level < MLFQ_LEVELS; level++)
+        {
+            rq_init(&cpu->mlfq[level]);
+        }
+        cpu->idle = new PCB;
+        init_pcb(cpu->idle, "IDLE", -1);
+        cpu->idle->state = RUNNING;
+        cpu->idle->cpu = i;
+        cpu->running = cpu->idle;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long long events_run = 0;
+    post(jobs[0].arrival, ARRIVAL, &jobs[0].pcb, 0);
+    while(!events.empty())
+    {
+        EVENT e = events.top();
+        events.pop();
+        now = e.time;
+        events_run++;
+
+        switch(e.type)
+        {
+        case ARRIVAL:
+            arrival(e.pcb);
+            break;
+        case EXIT:
+            exited(e.pcb, e.gen);
+            break;
+        case TICK:
+            tick();
+            break;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double wall = (end.tv_sec - start.tv_sec) +
+        (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if(verbose)
+    {
+        printf("%-16s %12s %10s %12s %12s %10s %10s\n", "name", "arrival",
+            "burst", "first_run", "finish", "interrupts", "switches");
+        for(size_t i = 0; i < jobs.size(); i++)
+        {
+            JOB *job = &jobs[i];
+            printf("%-16s %12lld %10lld %12lld %12lld %10d %10d\n", job->name,
+                job->arrival, job->burst, job->first_run, job->finish,
+                job->pcb.interrupts, job->pcb.switches);
+        }
+    }
+    report(events_run, wall);
+    return(0);
+}
@@ -0,0 +1,462 @@
+// Author: Nick Barnes
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/*
+** A work-stealing thread pool and a parallel for over it. The pool's
+** threads are made once, by tp_create(), and sleep between jobs, so a
+** tp_for() costs a wakeup and not a pthread_create() per thread. The
+** thread calling tp_for() is worker 0 and works too, so a pool of n has
+** n - 1 threads of its own.
+**
+** Each worker has a Chase-Lev deque of tasks, each task a range of
+** iterations. A worker takes its range, and while it is bigger than the
+** grain, pushes the top half onto the bottom of its own deque and carries
+** on with the bottom half; when it is down to the grain it runs it. It
+** then pops its own deque from the bottom, newest and smallest first,
+** and when that is empty steals from the top of another's, oldest and so
+** biggest first. So a job spreads out in log(workers) steals, and only
+** runs out of work at the very end.
+**
+** The deque is after Le, Pop, Cohen and Zappa Nardelli, "Correct and
+** Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013): the owner
+** pushes and pops the bottom without a lock, and only fights the thieves,
+** with a compare and swap on top, for the last task.
+**
+** Given a list of CPUs, tp_create() pins worker i to cpus[i], the caller
+** included, until tp_destroy() puts the caller back where it was.
+*/
+
+#define TP_DEQUE 1024       // tasks in a deque, a power of two
+#define TP_SPIN 64          // failed steals before a worker yields
+#define TP_GRAINS 8         // auto grain: aim for this many per worker
+
+struct tp_job;
+
+struct tp_task
+{
+    long lo;
+    long hi;
+};
+
+// top and bottom are on separate cache lines: bottom is the owner's,
+// top is fought over by the thieves.
+struct tp_deque
+{
+    long top;
+    char pad0[56];
+    long bottom;
+    char pad1[56];
+    struct tp_task *tasks[TP_DEQUE];
+};
+
+struct tp_worker
+{
+    struct tp_deque deque;
+    struct tp_pool *pool;
+    int index;
+    unsigned seed;          // for picking victims
+    int cpu;                // pinned to, or -1
+    pthread_t thread;
+};
+
+/*
+** one tp_for(). body(arg, lo, hi) runs iterations [lo, hi).
+** The tasks come out of one array made for the job, which is big enough
+** for every split the grain allows.
+*/
+struct tp_job
+{
+    void (*body)(void *arg, long lo, long hi);
+    void *arg;
+    long grain;
+    long left;              // iterations not yet run
+    struct tp_task *tasks;
+    long ntasks;
+    long used;              // tasks handed out
+};
+
+struct tp_pool
+{
+    int n;
+    struct tp_worker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // a job has started, or the pool is stopping
+    pthread_cond_t idle;    // a worker has left a job
+    struct tp_job *job;     // the running job, or NULL
+    unsigned generation;    // jobs started so far
+    int busy;               // workers, other than 0, inside job
+    bool stop;
+    bool pinned;            // the caller was pinned, from saved
+    cpu_set_t saved;
+};
+
+static __thread int tp_index = -1;
+
+/*
+** the calling thread's worker index in the pool it is working for, or -1
+** if it isn't working for one. Indexes run from 0 to n - 1, so they can
+** pick per-worker data, such as a count each.
+*/
+static inline int tp_self(void)
+{
+    return(tp_index);
+}
+
+static inline void tp_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/*
+** the owner: put t on the bottom. false if the deque is full.
+*/
+static inline bool tp_push(struct tp_deque *d, struct tp_task *t)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if(b - top >= TP_DEQUE)
+    {
+        return(false);
+    }
+    __atomic_store_n(&d->tasks[b & (TP_DEQUE - 1)], t, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return(true);
+}
+
+/*
+** the owner: take a task off the bottom, or NULL if it is empty.
+*/
+static inline struct tp_task *tp_pop(struct tp_deque *d)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    struct tp_task *t = NULL;
+    if(top <= b)
+    {
+        t = __atomic_load_n(&d->tasks[b & (TP_DEQUE - 1)], __ATOMIC_RELAXED);
+        if(top == b)
+        {
+            // the last one: a thief may be after it too.
+            if(!__atomic_compare_exchange_n(&d->top, &top, top + 1, false,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            {
+                t = NULL;
+            }
+            __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return(t);
+}
+
+/*
+** a thief: take a task off the top, or NULL if it is empty or another
+** thief got there first.
+*/
+static inline struct tp_task *tp_steal(struct tp_deque *d)
+{
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if(top >= b)
+    {
+        return(NULL);
+    }
+    struct tp_task *t = __atomic_load_n(&d->tasks[top & (TP_DEQUE - 1)],
+        __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&d->top, &top, top + 1, false,
+        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return(NULL);
+    }
+    return(t);
+}
+
+/*
+** run t, splitting off the top half onto w's deque for as long as it is
+** bigger than the grain.
+*/
+static inline void tp_run(struct tp_worker *w, struct tp_job *job,
+    struct tp_task *t)
+{
+    long lo = t->lo;
+    long hi = t->hi;
+    while(hi - lo > job->grain)
+    {
+        long i = __atomic_fetch_add(&job->used, 1, __ATOMIC_RELAXED);
+        if(i >= job->ntasks)
+        {
+            break;
+        }
+        long mid = lo + (hi - lo) / 2;
+        struct tp_task *half = &job->tasks[i];
+        half->lo = mid;
+        half->hi = hi;
+        if(!tp_push(&w->deque, half))
+        {
+            break;
+        }
+        hi = mid;
+    }
+    job->body(job->arg, lo, hi);
+    __atomic_fetch_sub(&job->left, hi - lo, __ATOMIC_RELEASE);
+}
+
+/*
+** work on job until every iteration of it has run: our own tasks first,
+** then other workers'.
+*/
+static inline void tp_work(struct tp_worker *w, struct tp_job *job)
+{
+    struct tp_pool *pool = w->pool;
+    int misses = 0;
+    while(__atomic_load_n(&job->left, __ATOMIC_ACQUIRE) > 0)
+    {
+        struct tp_task *t = tp_pop(&w->deque);
+        if(t == NULL && pool->n > 1)
+        {
+            int victim = rand_r(&w->seed) % (pool->n - 1);
+            victim += (victim >= w->index);
+            t = tp_steal(&pool->workers[victim].deque);
+        }
+        if(t != NULL)
+        {
+            tp_run(w, job, t);
+            misses = 0;
+            continue;
+        }
+        // whoever has the work may not be running; don't stand in its way.
+        tp_relax();
+        if(++misses % TP_SPIN == 0)
+        {
+            sched_yield();
+        }
+    }
+}
+
+static inline void tp_pin(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *tp_thread(void *arg)
+{
+    struct tp_worker *w = (struct tp_worker *)arg;
+    struct tp_pool *pool = w->pool;
+    tp_index = w->index;
+    if(w->cpu >= 0)
+    {
+        tp_pin(w->cpu);
+    }
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for(;;)
+    {
+        while(!pool->stop && (pool->job == NULL || pool->generation == seen))
+        {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if(pool->stop)
+        {
+            break;
+        }
+        seen = pool->generation;
+        struct tp_job *job = pool->job;
+        pool->busy++;
+        pthread_mutex_unlock(&pool->lock);
+
+        tp_work(w, job);
+
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->busy == 0)
+        {
+            pthread_cond_signal(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return(NULL);
+}
+
+/*
+** a pool of n workers: the caller and n - 1 threads, on cpus[0] to
+** cpus[n - 1] if cpus isn't NULL. NULL if the threads can't be made.
+*/
+static inline struct tp_pool *tp_create(int n, const int *cpus = NULL)
+{
+    struct tp_pool *pool = new tp_pool;
+    pool->n = n < 1 ? 1 : n;
+    pool->workers = new tp_worker[pool->n];
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->job = NULL;
+    pool->generation = 0;
+    pool->busy = 0;
+    pool->stop = false;
+    pool->pinned = (cpus != NULL);
+    if(pool->pinned)
+    {
+        pthread_getaffinity_np(pthread_self(), sizeof(pool->saved),
+            &pool->saved);
+        tp_pin(cpus[0]);
+    }
+    for(int i = 0; i < pool->n; i++)
+    {
+        struct tp_worker *w = &pool->workers[i];
+        w->deque.top = 0;
+        w->deque.bottom = 0;
+        w->pool = pool;
+        w->index = i;
+        w->seed = i * 2654435761u + 1;
+        w->cpu = cpus ? cpus[i] : -1;
+    }
+    for(int i = 1; i < pool->n; i++)
+    {
+        if(pthread_create(&pool->workers[i].thread, NULL, tp_thread,
+            &pool->workers[i]) != 0)
+        {
+            // stop the ones we have.
+            pool->n = i;
+            pthread_mutex_lock(&pool->lock);
+            pool->stop = true;
+            pthread_cond_broadcast(&pool->wake);
+            pthread_mutex_unlock(&pool->lock);
+            for(int j = 1; j < i; j++)
+            {
+                pthread_join(pool->workers[j].thread, NULL);
+            }
+            if(pool->pinned)
+            {
+                pthread_setaffinity_np(pthread_self(), sizeof(pool->saved),
+                    &pool->saved);
+            }
+            delete[] pool->workers;
+            delete pool;
+            return(NULL);
+        }
+    }
+    return(pool);
+}
+
+static inline void tp_destroy(struct tp_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for(int i = 1; i < pool->n; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    if(pool->pinned)
+    {
+        pthread_setaffinity_np(pthread_self(), sizeof(pool->saved),
+            &pool->saved);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+    delete[] pool->workers;
+    delete pool;
+}
+
+/*
+** run body(arg, lo, hi) over [from, to) in chunks of at most grain
+** iterations (or, if grain is 0, enough that each worker gets about
+** TP_GRAINS of them), and return when all of them have run. Only one
+** thread may call this on a pool at a time, and not from inside a body.
+*/
+static inline void tp_for(struct tp_pool *pool, long from, long to,
+    void (*body)(void *arg, long lo, long hi), void *arg, long grain)
+{
+    if(to <= from)
+    {
+        return;
+    }
+    struct tp_job job;
+    job.body = body;
+    job.arg = arg;
+    job.grain = grain;
+    if(job.grain <= 0)
+    {
+        job.grain = (to - from) / ((long)pool->n * TP_GRAINS);
+    }
+    if(job.grain < 1)
+    {
+        job.grain = 1;
+    }
+    job.left = to - from;
+    // halving never leaves a piece under half the grain.
+    job.ntasks = 2 * ((to - from) / job.grain) + 1;
+    job.tasks = new tp_task[job.ntasks];
+    job.used = 0;
+
+    struct tp_worker *me = &pool->workers[0];
+    struct tp_task all = { from, to };
+    tp_push(&me->deque, &all);
+    int outer = tp_index;
+    tp_index = 0;
+
+    if(pool->n > 1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->job = &job;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    tp_work(me, &job);
+
+    // every iteration has run, but the others may still be looking at job.
+    if(pool->n > 1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->job = NULL;
+        while(pool->busy > 0)
+        {
+            pthread_cond_wait(&pool->idle, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    tp_index = outer;
+    delete[] job.tasks;
+}
+
+template <class F>
+static void tp_call(void *f, long lo, long hi)
+{
+    (*(F *)f)(lo, hi);
+}
+
+/*
+** tp_for() with a lambda, or anything else callable as f(lo, hi).
+*/
+template <class F>
+void parallel_for(struct tp_pool *pool, long from, long to, F f,
+    long grain = 0)
+{
+    tp_for(pool, from, to, tp_call<F>, &f, grain);
+}
+
+#endif
@@ -0,0 +1,140 @@
+// Author: Nick Barnes
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include "runqueue.h"
+
+/*
+** A hierarchical timer wheel of PCBs, keyed on the tick they are due to
+** wake at (wake_at). Level 0 has a slot for each of the next TW_SLOTS
+** ticks, level 1 a slot for each of the next TW_SLOTS blocks of TW_SLOTS
+** ticks, and so on. Each slot is a RUNQUEUE, so a PCB uses the same links
+** on the wheel as on a run queue, and adding, cancelling (rq_remove()) and
+** expiring are O(1) and never allocate. Every TW_SLOTS ticks the next
+** slot of the level above is cascaded: its PCBs are spread out over the
+** levels below, now that they are closer.
+**
+** Timeouts further away than the wheel reaches, TW_SLOTS^TW_LEVELS ticks,
+** are cut down to fit.
+*/
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4
+
+template <class T>
+struct TIMERWHEEL
+{
+    int now;                                // the last tick advanced to
+    int count;                              // PCBs on the wheel
+    RUNQUEUE<T> slots[TW_LEVELS][TW_SLOTS];
+};
+
+template <class T>
+void tw_init(TIMERWHEEL<T> *w, int now)
+{
+    w->now = now;
+    w->count = 0;
+    for(int level = 0; level < TW_LEVELS; level++)
+    {
+        for(int slot = 0; slot < TW_SLOTS; slot++)
+        {
+            rq_init(&w->slots[level][slot]);
+        }
+    }
+}
+
+/*
+** put p, due delta ticks from now, on the slot that will come round
+** for it next.
+*/
+template <class T>
+void tw_place(TIMERWHEEL<T> *w, T *p, long long delta)
+{
+    int level = 0;
+    while(delta >= 1LL << (TW_BITS * (level + 1)))
+    {
+        level++;
+    }
+    int slot = (p->wake_at >> (TW_BITS * level)) & (TW_SLOTS - 1);
+    rq_push_back(&w->slots[level][slot], p);
+    w->count++;
+}
+
+/*
+** put p on the wheel to expire at tick p->wake_at, which is moved to the
+** next tick if it has already passed.
+*/
+template <class T>
+void tw_add(TIMERWHEEL<T> *w, T *p)
+{
+    long long delta = (long long)p->wake_at - w->now;
+    if(delta < 1)
+    {
+        delta = 1;
+    }
+    if(delta >= 1LL << (TW_BITS * TW_LEVELS))
+    {
+        delta = (1LL << (TW_BITS * TW_LEVELS)) - 1;
+    }
+    p->wake_at = w->now + (int)delta;
+    tw_place(w, p, delta);
+}
+
+/*
+** take p off the wheel before it expires.
+*/
+template <class T>
+void tw_cancel(TIMERWHEEL<T> *w, T *p)
+{
+    rq_remove(p->queue, p);
+    w->count--;
+}
+
+/*
+** move the wheel on to tick to, putting every PCB that expires on the way
+** on expired, in the order they expire.
+*/
+template <class T>
+void tw_advance(TIMERWHEEL<T> *w, int to, RUNQUEUE<T> *expired)
+{
+    while(w->now < to)
+    {
+        w->now++;
+        if(w->count == 0)
+        {
+            // nothing to expire or cascade; jump straight there.
+            w->now = to;
+            break;
+        }
+
+        // at each wrap of a level, bring the next slot of the one above
+        // down.
+        for(int level = 1; level < TW_LEVELS; level++)
+        {
+            if((w->now & ((1 << (TW_BITS * level)) - 1)) != 0)
+            {
+                break;
+            }
+            int slot = (w->now >> (TW_BITS * level)) & (TW_SLOTS - 1);
+            T *p;
+            while((p = rq_pop_front(&w->slots[level][slot])) != NULL)
+            {
+                // anything due now goes on the level 0 slot expired below.
+                w->count--;
+                tw_place(w, p, (long long)p->wake_at - w->now);
+            }
+        }
+
+        T *p;
+        RUNQUEUE<T> *due = &w->slots[0][w->now & (TW_SLOTS - 1)];
+        while((p = rq_pop_front(due)) != NULL)
+        {
+            w->count--;
+            rq_push_back(expired, p);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,201 @@
+// Author: Nick Barnes
+
+#include <iostream>
+#include <list>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include "pidtable.h"
+
+/*
+** Measures the kernel's cost of finding and serving one kernel call as
+** the number of live processes grows.
+**
+** "scan" is the old incoming_message(): rotate the processes list and
+** read() each request pipe until one has something in it. "lookup" is the
+** new one: the SIGTRAP's si_pid names the caller, which is found in the
+** kernel's own by_pid table (pidtable.h) and read directly. Each call comes from a random process.
+** The optional argument is the number of calls to time for each n.
+**
+** $ ./trap_bench 2000
+**        n    scan ns/call  lookup ns/call
+**       10           806.5           182.7
+**      100          7117.2           179.8
+**     1000         71866.4           271.5
+**     5000        502650.1           532.0
+*/
+
+#define READ 0
+#define WRITE 1
+
+using namespace std;
+
+struct PCB
+{
+    int pid;
+    int child2parent[2];
+};
+
+long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+PCB *make_pcbs(int n)
+{
+    PCB *pcbs = new PCB[n];
+    for(int i = 0; i < n; i++)
+    {
+        pcbs[i].pid = i + 1;
+        if(pipe2(pcbs[i].child2parent, O_NONBLOCK) == -1)
+        {
+            perror("pipe2");
+            exit(1);
+        }
+    }
+    return(pcbs);
+}
+
+void free_pcbs(PCB *pcbs, int n)
+{
+    for(int i = 0; i < n; i++)
+    {
+        close(pcbs[i].child2parent[READ]);
+        close(pcbs[i].child2parent[WRITE]);
+    }
+    delete [] pcbs;
+}
+
+/*
+** the caller's request, as the child would write it.
+*/
+void call(PCB *p)
+{
+    if(write(p->child2parent[WRITE], "1", 1) != 1)
+    {
+        perror("write");
+        exit(1);
+    }
+}
+
+bool serve(PCB *p)
+{
+    char buffer[1024];
+    return(read(p->child2parent[READ], buffer, sizeof(buffer)) > 0);
+}
+
+double time_scan(int n, int calls)
+{
+    PCB *pcbs = make_pcbs(n);
+    list<PCB *> processes;
+    for(int i = 0; i < n; i++)
+    {
+        processes.push_back(&pcbs[i]);
+    }
+
+    srandom(1);
+    long long elapsed = 0;
+    for(int c = 0; c < calls; c++)
+    {
+        call(&pcbs[random() % n]);
+        long long start = now_ns();
+        for(int i = 0; i < (int)processes.size(); i++)
+        {
+            PCB *torun = processes.front();
+            processes.pop_front();
+            processes.push_back(torun);
+            if(serve(torun))
+            {
+                break;
+            }
+        }
+        elapsed += now_ns() - start;
+    }
+
+    free_pcbs(pcbs, n);
+    return((double)elapsed / calls);
+}
+
+double time_lookup(int n, int calls)
+{
+    PCB *pcbs = make_pcbs(n);
+    PIDTABLE<PCB> by_pid;
+    pid_init(&by_pid, n);
+    for(int i = 0; i < n; i++)
+    {
+        pid_insert(&by_pid, &pcbs[i]);
+    }
+
+    srandom(1);
+    long long elapsed = 0;
+    for(int c = 0; c < calls; c++)
+    {
+        PCB *caller = &pcbs[random() % n];
+        call(caller);
+        int trap_pid = caller->pid;
+        long long start = now_ns();
+        PCB *found = pid_find(&by_pid, trap_pid);
+        if(found != NULL)
+        {
+            serve(found);
+        }
+        elapsed += now_ns() - start;
+    }
+
+    pid_free(&by_pid);
+    free_pcbs(pcbs, n);
+    return((double)elapsed / calls);
+}
+
+void usage(const char *me)
+{
+    fprintf(stderr, "usage: %s [calls]\n", me);
+    fprintf(stderr, "  calls  calls to time for each n, at least 1"
+        " (default 2000)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int calls = 2000;
+    if(argc > 2)
+    {
+        usage(argv[0]);
+    }
+    if(argc == 2)
+    {
+        char *end;
+        long arg = strtol(argv[1], &end, 10);
+        if(end == argv[1] || *end != '\0' || arg < 1 || arg > 1000000000)
+        {
+            usage(argv[0]);
+        }
+        calls = (int)arg;
+    }
+
+    // two descriptors a process.
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    printf("%8s %15s %15s\n", "n", "scan ns/call", "lookup ns/call");
+    int sizes[] = { 10, 100, 1000, 5000 };
+    for(int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+    {
+        int n = sizes[i];
+        if(2 * n + 16 > (int)rl.rlim_cur)
+        {
+            break;
+        }
+        printf("%8d %15.1f %15.1f\n", n, time_scan(n, calls),
+            time_lookup(n, calls));
+    }
+    return(0);
+}